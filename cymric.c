@@ -1,4 +1,9 @@
 #include "cymric.h"
+#include "cymric_internal.h"
+#include "cymric_events.h"
+#include "cymric_heap.h"
+
+#include <stddef.h>
 
 #include "cmsis_armcc.h"
 #include "stm32f4xx_hal.h"
@@ -7,36 +12,117 @@
 // Globals for use in context switches
 // These should be updated just prior to the context switch
 typedef struct {
-	uint8_t cur_task; // Current task
+	CymricTCB *cur_tcb; // Current task
 	
 	// These need to be double pointers so that the asm in PendSV_Handler has 
-	// a consistent memory address to access when getting them from the s_tcbs array.
+	// a consistent memory address to access when getting them from the TCBs.
 	uint32_t **cur_top_addr; // Pointer to current top address
 	uint32_t **next_top_addr; // Pointer to next top address
+#if CYMRIC_MPU_STACK_GUARD
+	uint32_t next_mpu_rbar; // MPU RBAR value for the next task's guard region
+#endif
+#if CYMRIC_RUN_STATS
+	uint32_t switch_cycles; // DWT->CYCCNT at the last context switch
+	uint32_t switches; // Number of context switches
+	uint64_t total_cycles; // Cycles accounted to tasks since starting
+#endif
 } ContextSwitchInfo;
 
-// Task control block definition
-typedef struct CymricTCB {
-	uint8_t id;
-	uint32_t *addr; // Base address of task stack
-	uint32_t *top_addr; // Address of top of task stack
-	CymricPriority pri;
-	struct CymricTCB *next; // For use in linked-list implementation
-} CymricTCB;
-
-// Task control blocks
+// Task control blocks for tasks using the RTOS's stacks
 static CymricTCB s_tcbs[CYMRIC_MAX_TASKS];
 
 // Current task ID to be used for a new task
 static uint8_t s_cur_alloc_id;
 
-static uint32_t s_ticks_ms;
+// TCBs from s_tcbs which have been freed by deleting their tasks, linked through next
+static CymricTCB *s_free_tcbs;
+
+// Top of the RTOS's task stacks (that of the idle task), just below the main stack
+static uint32_t *s_stacks_top;
+
+// Task IDs in use, one bit per ID.  Tasks with their own TCBs take the lowest free ID from CYMRIC_MAX_TASKS up 
+// and give it back when deleted, so that IDs stay unique (the lower IDs belong to the TCBs in s_tcbs).
+#define NUM_TASK_IDS 256
+static uint32_t s_used_ids[NUM_TASK_IDS / 32];
+
+// Give a TCB which isn't one of the RTOS's a free task ID.  Returns false if there are none left.
+// Must be called in a critical section.
+static bool prv_id_alloc(CymricTCB *tcb) {
+	for(uint8_t i = CYMRIC_MAX_TASKS / 32; i < NUM_TASK_IDS / 32; i++) {
+		uint32_t free = ~s_used_ids[i];
+		if(i == CYMRIC_MAX_TASKS / 32) {
+			free &= ~0ul << (CYMRIC_MAX_TASKS % 32);
+		}
+		if(free) {
+			uint8_t bit = 31 - __clz(free & -free); // Lowest free ID
+			s_used_ids[i] |= 1ul << bit;
+			tcb->id = i * 32 + bit;
+			return true;
+		}
+	}
+	return false;
+}
+
+// Release the ID of a TCB which isn't one of the RTOS's.  Must be called in a critical section.
+static void prv_id_free(CymricTCB *tcb) {
+	s_used_ids[tcb->id / 32] &= ~(1ul << (tcb->id % 32));
+}
+
+#if CYMRIC_HEAP
+// Tasks from cymric_task_new_heap() which deleted themselves, linked through next.  Their memory can't be freed
+// until they have been switched away from, so it is freed later by prv_heap_reap().
+static CymricTCB *s_heap_zombies;
+#endif
+
+// Assign one of the RTOS's stacks to a TCB from s_tcbs, based on its position in the array.
+static void prv_pool_stack_assign(CymricTCB *tcb) {
+	tcb->addr = s_stacks_top - (tcb - s_tcbs) * (CYMRIC_THREAD_STACK_SIZE / 4); // 4 bytes in uint32
+	tcb->stack_limit = tcb->addr - CYMRIC_THREAD_STACK_SIZE / 4;
+}
+
+static volatile uint32_t s_ticks_ms;
 
 ContextSwitchInfo switch_info;
 
+// Whether the DWT cycle counter is used
+#define USE_CYCLE_COUNTER (CYMRIC_RUN_STATS || CYMRIC_TRACE)
+
+#if CYMRIC_TRACE
+#if CYMRIC_TRACE_SIZE & (CYMRIC_TRACE_SIZE - 1)
+#error "CYMRIC_TRACE_SIZE must be a power of 2"
+#endif
+
+CymricTrace cymric_trace = {.magic = CYMRIC_TRACE_MAGIC, .size = CYMRIC_TRACE_SIZE};
+#endif
+
+// Get the task whose context PendSV_Handler last loaded, which is the one running (unlike switch_info.cur_tcb,
+// which changes as soon as a switch is requested).  Only valid once the RTOS has started.
+static inline CymricTCB *prv_loaded_tcb(void) {
+	return (CymricTCB*)((uint8_t*)switch_info.cur_top_addr - offsetof(CymricTCB, top_addr));
+}
+
 // Flag to allow context switches and schedling to occur.
 static bool s_started_flag;
 
+#if CYMRIC_KERNEL_IRQ_PRIORITY < 1 || CYMRIC_KERNEL_IRQ_PRIORITY >= (1 << __NVIC_PRIO_BITS)
+#error "CYMRIC_KERNEL_IRQ_PRIORITY must be between 1 and the lowest interrupt priority"
+#endif
+
+#if CYMRIC_SYSTICK_PRIORITY < CYMRIC_KERNEL_IRQ_PRIORITY
+#error "SysTick must be masked by the kernel's critical sections"
+#endif
+
+// BASEPRI value masking interrupts which may call the kernel
+#define KERNEL_BASEPRI ((CYMRIC_KERNEL_IRQ_PRIORITY << (8 - __NVIC_PRIO_BITS)) & 0xFF)
+
+// Whether kernel functions are running on behalf of an interrupt handler, in which case context switches are 
+// deferred to PendSV_Handler
+static bool s_defer_schedule;
+
+// Whether PendSV_Handler needs to run the scheduler before switching, and why
+static bool s_schedule_deferred;
+static CymricTraceReason s_deferred_reason;
+
 // List to contain all TCBs to run at a given priority
 // Need access to head for removal and tail for insertion
 typedef struct {
@@ -47,9 +133,44 @@ typedef struct {
 // One list for each priority
 static List s_ready[NUM_CYMRIC_PRIORITIES];
 
-// Bitset of whether priority list has TCBs in it
-static uint32_t s_pri_mask;
+#if NUM_CYMRIC_PRIORITIES > 256
+#error "NUM_CYMRIC_PRIORITIES must be at most 256"
+#endif
+
+// Two-level bitset of whether priority list has TCBs in it.  Each group word has one bit per priority,
+// and s_pri_groups has one bit per group word that is non-zero.
 #define PRI_MASK_CLZ_MAX 31 // max number of leading zeros
+#define PRI_GROUP_SHIFT 5 // log2 of the priorities in a group
+#define PRI_GROUP_BITS (1 << PRI_GROUP_SHIFT)
+#define NUM_PRI_GROUPS ((NUM_CYMRIC_PRIORITIES + PRI_GROUP_BITS - 1) / PRI_GROUP_BITS)
+static uint32_t s_pri_groups;
+static uint32_t s_pri_mask[NUM_PRI_GROUPS];
+
+// Mark the list for a priority as non-empty.
+static inline void prv_pri_set(CymricPriority pri) {
+	s_pri_mask[pri >> PRI_GROUP_SHIFT] |= 1ul << (pri & (PRI_GROUP_BITS - 1));
+	s_pri_groups |= 1ul << (pri >> PRI_GROUP_SHIFT);
+}
+
+// Mark the list for a priority as empty.
+static inline void prv_pri_clear(CymricPriority pri) {
+	uint8_t group = pri >> PRI_GROUP_SHIFT;
+	s_pri_mask[group] &= ~(1ul << (pri & (PRI_GROUP_BITS - 1)));
+	if(!s_pri_mask[group]) {
+		s_pri_groups &= ~(1ul << group);
+	}
+}
+
+// Whether any task is in a ready list.
+static inline bool prv_any_ready(void) {
+	return s_pri_groups != 0;
+}
+
+// Get the highest priority with a non-empty ready list.  At least one must be non-empty.
+static inline CymricPriority prv_highest_ready(void) {
+	uint8_t group = PRI_MASK_CLZ_MAX - __clz(s_pri_groups);
+	return (group << PRI_GROUP_SHIFT) + (PRI_MASK_CLZ_MAX - __clz(s_pri_mask[group]));
+}
 
 // Insert a TCB into the list corresponding to its priority.
 static void prv_insert(CymricTCB *tcb, CymricPriority pri) {
@@ -58,7 +179,7 @@ static void prv_insert(CymricTCB *tcb, CymricPriority pri) {
 	} else {
 		// List was empty
 		s_ready[pri].head = tcb;
-		s_pri_mask |= 1 << pri;
+		prv_pri_set(pri);
 	}
 	
 	// TCB is now the last in the list
@@ -76,38 +197,397 @@ static CymricTCB *prv_remove(CymricPriority pri) {
 		if(!s_ready[pri].head) {
 			// List is now empty
 			s_ready[pri].tail = NULL;
-			s_pri_mask &= ~(1 << pri);
+			prv_pri_clear(pri);
 		}
 		return ret;
 	}
 }
+
+#if CYMRIC_STACK_CHECK
+// Fill the stack region given with CYMRIC_STACK_PAINT.
+static void prv_stack_paint(uint32_t *from, uint32_t *to) {
+	for(; from < to; from++) {
+		*from = CYMRIC_STACK_PAINT;
+	}
+}
+
+// Check a task's stack for overflow, calling cymric_stack_overflow_hook() if it has.  The top of stack last 
+// saved by PendSV_Handler must be within its stack, and the word at the bottom of its stack must still be painted.
+static inline void prv_stack_check(CymricTCB *tcb) {
+	if(tcb->top_addr < tcb->stack_limit || *tcb->stack_limit != CYMRIC_STACK_PAINT) {
+		cymric_stack_overflow_hook(tcb);
+	}
+}
+
+// Check the stack of the task being switched out, called by PendSV_Handler once it has saved the task's context
+// (so its top of stack is up to date; it is stale while prv_schedule() runs).
+static void prv_stack_check_outgoing(void) {
+	prv_stack_check(prv_loaded_tcb());
+}
+
+#endif
+
+#if CYMRIC_STACK_CHECK || CYMRIC_MPU_STACK_GUARD
+__weak void cymric_stack_overflow_hook(CymricTask *task) {
+	// Halt, since the overflow has likely corrupted other tasks
+	while(1) {}
+}
+#endif
+
+#if CYMRIC_MPU_STACK_GUARD
+// Size of the MPU stack guard region, and the value of the RASR SIZE field for it (size = 2^(SIZE + 1))
+#define MPU_GUARD_SIZE 32
+#define MPU_GUARD_RASR_SIZE 4
+
+// Reserve the lowest MPU_GUARD_SIZE-aligned block of a task's stack as its guard region, moving the
+// bottom of the usable stack above it.
+static void prv_stack_guard_init(CymricTCB *tcb) {
+	uint32_t guard = ((uint32_t)tcb->stack_limit + MPU_GUARD_SIZE - 1) & ~(MPU_GUARD_SIZE - 1ul);
+	tcb->stack_limit = (uint32_t*)(guard + MPU_GUARD_SIZE);
 	
+	// Setting VALID selects the region through RBAR, so PendSV_Handler only needs to write this one register
+	tcb->mpu_rbar = guard | MPU_RBAR_VALID_Msk | CYMRIC_MPU_GUARD_REGION;
+}
 
-// Schedule tasks using fixed-priority pre-emptive scheduling.  
-// Should be called in SysTick_Handler().
-static inline void prv_schedule(void) {
-	// If the only task is the idle task, continue running it
-	if(s_pri_mask == 1 << CYMRIC_PRI_IDLE) {
+// Program the MPU guard region for the task given and enable the MPU.
+static void prv_stack_guard_start(CymricTCB *tcb) {
+	MPU->RBAR = tcb->mpu_rbar;
+	
+	// No access, even from privileged code, and never executable
+	MPU->RASR = (MPU_GUARD_RASR_SIZE << MPU_RASR_SIZE_Pos) | (0ul << MPU_RASR_AP_Pos) | MPU_RASR_XN_Msk 
+		| MPU_RASR_ENABLE_Msk;
+	
+	// Keep the default memory map everywhere else
+	MPU->CTRL = MPU_CTRL_PRIVDEFENA_Msk | MPU_CTRL_ENABLE_Msk;
+	SCB->SHCSR |= SCB_SHCSR_MEMFAULTENA_Msk;
+	__dsb(0xF);
+	__isb(0xF);
+}
+
+// Handler for memory management faults.  These are assumed to come from a task overflowing its stack into 
+// its guard region.
+void MemManage_Handler(void) {
+	// The guard region programmed belongs to the task whose context PendSV_Handler last loaded 
+	cymric_stack_overflow_hook(prv_loaded_tcb());
+}
+#endif
+
+#if CYMRIC_RUN_STATS
+// Offsets of TCB and switch info fields from those that PendSV_Handler has the addresses of
+#define TCB_OFFSET(field) (offsetof(CymricTCB, field) - offsetof(CymricTCB, top_addr))
+#define SWITCH_OFFSET(field) (offsetof(ContextSwitchInfo, field) - offsetof(ContextSwitchInfo, switch_cycles))
+
+// Charge the cycles since the last context switch to the running task, as PendSV_Handler does.  Must be called
+// in a critical section, and often enough that DWT->CYCCNT can't wrap around in between.
+static void prv_run_stats_update(void) {
+	uint32_t now = DWT->CYCCNT;
+	uint32_t cycles = now - switch_info.switch_cycles;
+	switch_info.switch_cycles = now;
+	prv_loaded_tcb()->run_cycles += cycles;
+	switch_info.total_cycles += cycles;
+}
+#endif
+
+#if USE_CYCLE_COUNTER && CYMRIC_TICKLESS_IDLE
+// Make up for DWT->CYCCNT not counting while the processor sleeps (the core clock is gated in sleep mode 
+// unless a debugger keeps it running), given its value before sleeping and the number of SysTick cycles slept.
+// SysTick is assumed to be clocked from the processor clock, as set up by HAL_Init().
+static void prv_cycle_count_sleep(uint32_t start, uint32_t slept) {
+	uint32_t counted = DWT->CYCCNT - start;
+	if(counted < slept) {
+		DWT->CYCCNT += slept - counted;
+	}
+}
+#endif
+
+#if CYMRIC_TRACE
+// Record a context switch in the trace buffer.  Must be called in a critical section.
+static void prv_trace_switch(CymricTraceReason reason, CymricTCB *from, CymricTCB *to) {
+	CymricTraceEvent *event = &cymric_trace.events[cymric_trace.count & (CYMRIC_TRACE_SIZE - 1)];
+	event->timestamp = DWT->CYCCNT;
+	event->reason = reason;
+	event->from_id = from->id;
+	event->to_id = to->id;
+	event->to_pri = to->pri;
+	cymric_trace.count++;
+}
+#endif
+
+// Schedule tasks using fixed-priority pre-emptive scheduling, for the reason given.  
+// Should be called in SysTick_Handler() or in a critical section.
+static void prv_schedule(CymricTraceReason reason) {
+	CymricTCB *cur = switch_info.cur_tcb;
+	
+	// Interrupt handlers only update the ready lists; PendSV_Handler decides whether to switch once they return
+	if(s_defer_schedule) {
+		s_schedule_deferred = true;
+		s_deferred_reason = reason;
+		SCB->ICSR |= SCB_ICSR_PENDSVSET_Msk;
+		return;
+	}
+	
+	// If no other task is ready, continue running the current one (the idle task never blocks,
+	// so this can only happen while a task is running)
+	if(!prv_any_ready()) {
 		return;
 	}
 	
 	// Get the highest task scheduled to run
-	uint8_t highest_sched = PRI_MASK_CLZ_MAX - __clz(s_pri_mask);
+	CymricPriority highest_sched = prv_highest_ready();
+	
+	// If the current task is still runnable, only switch away from it if its priority is lower than or equal 
+	// to the highest available, in which case insert it back at the end of its list
+	if(cur->state == CYMRIC_TASK_STATE_RUNNING) {
+		if(cur->pri > highest_sched) {
+			return;
+		}
+		cur->state = CYMRIC_TASK_STATE_READY;
+		prv_insert(cur, cur->pri);
+	}
+	
+	// Remove the next available task and set the current running task to it
+	CymricTCB *next = prv_remove(highest_sched);
+	next->state = CYMRIC_TASK_STATE_RUNNING;
+	next->slice_left_ms = next->slice_ms;
+	
+#if CYMRIC_STACK_CHECK
+	// The current task's stack is checked by PendSV_Handler, once its top of stack has been saved
+	prv_stack_check(next);
+#endif
+	
+#if CYMRIC_TRACE
+	prv_trace_switch(reason, cur, next);
+#endif
+	CYMRIC_EVENT_TASK_SWITCH(cur, next);
+	
+	// Update switch info for the context switch.  The outgoing context is tracked by PendSV_Handler itself,
+	// so calling this multiple times before the switch occurs only changes the task switched to.
+	switch_info.next_top_addr = &next->top_addr;
+#if CYMRIC_MPU_STACK_GUARD
+	switch_info.next_mpu_rbar = next->mpu_rbar;
+#endif
+	switch_info.cur_tcb = next; // now the next task
+	
+	// Initiate a context switch
+	SCB->ICSR |= SCB_ICSR_PENDSVSET_Msk;
+}
+
+// Leave the critical section the calling task is in completely (however deeply it is nested) so that a context 
+// switch requested by prv_schedule() can occur, then re-enter it.  Must be called in a critical section.
+static void prv_switch_point(void) {
+	__set_BASEPRI(0);
+	__isb(0xF);
+	__set_BASEPRI(KERNEL_BASEPRI);
+	__isb(0xF);
+}
+
+// Request a context switch if a task with a higher priority than the running task is ready.
+// Does nothing if the current task is blocking, since it will call prv_schedule() itself.
+static void prv_preempt(void) {
+	CymricTCB *cur = switch_info.cur_tcb;
+	if(s_started_flag && cur->state == CYMRIC_TASK_STATE_RUNNING && prv_any_ready() && prv_highest_ready() > cur->pri) {
+		prv_schedule(CYMRIC_TRACE_PREEMPT);
+	}
+}
+
+// Make a TCB ready to run, switching to it immediately if it has a higher priority than the running task.
+// Should be called in SysTick_Handler() or in a critical section.
+static void prv_ready(CymricTCB *tcb) {
+	tcb->state = CYMRIC_TASK_STATE_READY;
+	prv_insert(tcb, tcb->pri);
 	
-	// If priority of current task is lower than or equal to highest available, insert it back, remove the 
-	// next available task, and set the current running task to the next available
-	if(s_tcbs[switch_info.cur_task].pri <= highest_sched) {
-		prv_insert(&s_tcbs[switch_info.cur_task], s_tcbs[switch_info.cur_task].pri);
-		CymricTCB *next = prv_remove((CymricPriority)highest_sched);
+	CymricTCB *cur = switch_info.cur_tcb;
+	if(s_started_flag && cur->state == CYMRIC_TASK_STATE_RUNNING && tcb->pri > cur->pri) {
+		prv_schedule(CYMRIC_TRACE_WAKE);
+	}
+}
+
+// Delta list of sleeping tasks, ordered by wakeup time.
+static CymricTCB *s_sleeping;
+
+// Insert a TCB into the sleep queue, to be woken up after the number of ticks given (must be > 0).
+static void prv_sleep_insert(CymricTCB *tcb, uint32_t ticks) {
+	CymricTCB **cur = &s_sleeping;
+	
+	// Walk past every TCB that wakes up at or before this one, making the delay relative as we go
+	while(*cur && (*cur)->sleep_delta <= ticks) {
+		ticks -= (*cur)->sleep_delta;
+		cur = &(*cur)->sleep_next;
+	}
+	
+	// The following TCB now wakes up relative to this one
+	if(*cur) {
+		(*cur)->sleep_delta -= ticks;
+	}
+	
+	tcb->sleep_delta = ticks;
+	tcb->sleep_next = *cur;
+	if(*cur) {
+		(*cur)->sleep_pprev = &tcb->sleep_next;
+	}
+	tcb->sleep_pprev = cur;
+	*cur = tcb;
+}
+
+// Remove a TCB from the sleep queue if it is in it.
+static void prv_sleep_remove(CymricTCB *tcb) {
+	if(!tcb->sleep_pprev) {
+		return;
+	}
+	
+	// The following TCB now wakes up relative to the previous one
+	CymricTCB *next = tcb->sleep_next;
+	if(next) {
+		next->sleep_delta += tcb->sleep_delta;
+		next->sleep_pprev = tcb->sleep_pprev;
+	}
+	*tcb->sleep_pprev = next;
+	tcb->sleep_next = NULL;
+	tcb->sleep_pprev = NULL;
+}
+
+// Insert a TCB into a wait list after all TCBs with a priority greater than or equal to its own (or after
+// all TCBs for FIFO lists).
+static void prv_wait_insert(CymricWaitList *list, CymricTCB *tcb) {
+	CymricTCB **cur = &list->head;
+	while(*cur && (list->fifo || (*cur)->pri >= tcb->pri)) {
+		cur = &(*cur)->next;
+	}
+	tcb->next = *cur;
+	*cur = tcb;
+	tcb->wait_list = list;
+}
+
+// Unlink a TCB from the wait list it is blocked on.
+static void prv_wait_unlink(CymricTCB *tcb) {
+	for(CymricTCB **cur = &tcb->wait_list->head; *cur; cur = &(*cur)->next) {
+		if(*cur == tcb) {
+			*cur = tcb->next;
+			break;
+		}
+	}
+	tcb->wait_list = NULL;
+}
+
+// Remove a TCB from the ready list corresponding to its priority.
+static void prv_ready_remove(CymricTCB *tcb) {
+	List *list = &s_ready[tcb->pri];
+	CymricTCB *prev = NULL;
+	for(CymricTCB *cur = list->head; cur; prev = cur, cur = cur->next) {
+		if(cur == tcb) {
+			if(prev) {
+				prev->next = tcb->next;
+			} else {
+				list->head = tcb->next;
+			}
+			
+			if(list->tail == tcb) {
+				list->tail = prev;
+			}
+			
+			if(!list->head) {
+				// List is now empty
+				prv_pri_clear(tcb->pri);
+			}
+			return;
+		}
+	}
+}
+
+// Get the priority a task should run at: its base priority, raised to the ceiling of any object it owns and 
+// to the priority of the highest-priority task waiting on any of them.
+static CymricPriority prv_inherited_pri(CymricTCB *tcb) {
+	CymricPriority pri = tcb->base_pri;
+	for(CymricWaitList *list = tcb->owned; list; list = list->next_owned) {
+		if(list->ceiling > pri) {
+			pri = list->ceiling;
+		}
 		
-		// Update switch info for the context switch
-		switch_info.next_top_addr = &next->top_addr;
+		// Wait lists are ordered by priority, so only the head needs to be checked
+		if(list->head && list->head->pri > pri) {
+			pri = list->head->pri;
+		}
+	}
+	return pri;
+}
+
+// Change the effective priority of a task, moving it within whichever list it is in.  If the task is blocked
+// on an owned object, the change is passed on to the owner so that inheritance is transitive across nested 
+// mutexes.
+static void prv_set_pri(CymricTCB *tcb, CymricPriority pri) {
+	while(tcb && tcb->pri != pri) {
+		CYMRIC_EVENT_TASK_PRIORITY(tcb, pri);
+		if(tcb->state == CYMRIC_TASK_STATE_READY) {
+			prv_ready_remove(tcb);
+			tcb->pri = pri;
+			prv_insert(tcb, pri);
+			prv_preempt();
+			return;
+		}
 		
-		switch_info.cur_top_addr = &s_tcbs[switch_info.cur_task].top_addr;
-		switch_info.cur_task = next->id; // now the next task
+		tcb->pri = pri;
+		if(tcb->state == CYMRIC_TASK_STATE_RUNNING) {
+			// Another task may now need to pre-empt it
+			prv_preempt();
+			return;
+		}
 		
-		// Initiate a context switch
-		SCB->ICSR |= SCB_ICSR_PENDSVSET_Msk;
+		if(!tcb->wait_list) {
+			return;
+		}
+		
+		// Re-sort the task within the wait list it is blocked on, then update the owner of that list
+		CymricWaitList *list = tcb->wait_list;
+		if(list->fifo) {
+			return;
+		}
+		prv_wait_unlink(tcb);
+		prv_wait_insert(list, tcb);
+		
+		tcb = list->owner;
+		if(tcb) {
+			pri = prv_inherited_pri(tcb);
+		}
+	}
+}
+
+// Update the inherited priority of the owner of a wait list (if any) after its waiters have changed.
+static void prv_update_owner(CymricWaitList *list) {
+	if(list->owner) {
+		prv_set_pri(list->owner, prv_inherited_pri(list->owner));
+	}
+}
+
+// Remove a TCB from the wait list it is blocked on.
+static void prv_wait_remove(CymricTCB *tcb) {
+	CymricWaitList *list = tcb->wait_list;
+	prv_wait_unlink(tcb);
+	prv_update_owner(list);
+}
+
+// Advance the sleep queue by one tick, moving any TCBs whose delay has expired back into the ready lists.
+// Should be called in SysTick_Handler().
+static void prv_sleep_tick(void) {
+	if(!s_sleeping) return;
+	
+	s_sleeping->sleep_delta--;
+	while(s_sleeping && s_sleeping->sleep_delta == 0) {
+		CymricTCB *tcb = s_sleeping;
+		s_sleeping = tcb->sleep_next;
+		if(s_sleeping) {
+			s_sleeping->sleep_pprev = &s_sleeping;
+		}
+		tcb->sleep_next = NULL;
+		tcb->sleep_pprev = NULL;
+		
+		// If the task was waiting on an object, the wait has timed out
+		if(tcb->wait_list) {
+			prv_wait_remove(tcb);
+			tcb->timed_out = true;
+		}
+		
+		CYMRIC_EVENT_TASK_UNBLOCK(tcb, true);
+		prv_ready(tcb);
 	}
 }
 
@@ -116,68 +596,340 @@ void SysTick_Handler(void) {
 	s_ticks_ms++;
 	HAL_IncTick(); // to be removed once unnecessary
 	
-	// Perform scheduling if necessary
-	if(s_started_flag && (s_ticks_ms % CYMRIC_SCHED_INT_MS == 0)) {
-			prv_schedule();
+	if(!s_started_flag) {
+		return;
+	}
+	CYMRIC_ISR_ENTER();
+	
+#if CYMRIC_RUN_STATS
+	// Keep DWT->CYCCNT from wrapping around between context switches
+	prv_run_stats_update();
+#endif
+	
+#if CYMRIC_TIMERS
+	cymric_timer_tick();
+#endif
+	
+	// Wake up any tasks whose delays have expired (which may pre-empt the running task)
+	CymricTCB *cur = switch_info.cur_tcb;
+	prv_sleep_tick();
+	
+	// Rotate the running task out once its time slice is used up
+	if(cur->state == CYMRIC_TASK_STATE_RUNNING && cur->slice_ms != CYMRIC_SLICE_NONE && --cur->slice_left_ms == 0) {
+		prv_schedule(CYMRIC_TRACE_TICK);
+		
+		// Start a new slice if no other task could be switched to
+		if(cur->state == CYMRIC_TASK_STATE_RUNNING) {
+			cur->slice_left_ms = cur->slice_ms;
+		}
 	}
+	
+	CYMRIC_ISR_EXIT();
+}
+
+// Run the scheduler on behalf of an interrupt handler which deferred it.  Called by PendSV_Handler with interrupts
+// disabled before it switches tasks.  If the running task should keep running, switch_info.next_top_addr is left
+// pointing to its own context.
+static void prv_schedule_deferred(void) {
+	s_schedule_deferred = false;
+	prv_schedule(s_deferred_reason);
+	
+	// PendSV_Handler is already running, so doesn't need to run again
+	SCB->ICSR = SCB_ICSR_PENDSVCLR_Msk;
 }
 
 // Handler for context switches
 __asm void PendSV_Handler(void) {
+	// Prevent SysTick from updating the switch info partway through the switch.  PendSV_Handler can only run
+	// outside of critical sections, so the mask is cleared again afterwards.
+	MOV R0,#__cpp(KERNEL_BASEPRI)
+	MSR BASEPRI,R0
+	
+	// Run the scheduler if an interrupt handler deferred it.  R0-R3 and R12 are in the exception frame; LR is 
+	// saved around the call along with R4 to keep the main stack 8-byte aligned.
+	LDR R0,=__cpp(&s_schedule_deferred)
+	LDRB R0,[R0]
+	CBZ R0,pendsv_switch
+	PUSH {R4,LR}
+	BL __cpp(prv_schedule_deferred)
+	POP {R4,LR}
+	
+pendsv_switch
 	// Since this is an exception and as such occurs in handler mode,
 	// need to get the PSP into a register to access it.
 	MRS R2,PSP 
 	
-	// Push R4-R11 onto the process stack
-	STMFD R2!,{R4-R11} 
+#if (__FPU_USED == 1)
+	// If the task has used the FPU (EXC_RETURN bit 4 clear), the processor has reserved space for S0-S15 
+	// in the exception frame; push S16-S31 as well.  This also triggers the lazy stacking of S0-S15.
+	TST LR,#EXC_RETURN_BASIC_FRAME_Msk
+	IT EQ
+	VSTMDBEQ R2!,{S16-S31}
+#endif
+	
+	// Push R4-R11 onto the process stack, along with EXC_RETURN so that the frame type is known 
+	// when switching back to the task
+	STMFD R2!,{R4-R11,LR} 
 	
 	// Copy current top of stack into the TCB for the current task
-	LDR R4,=__cpp(&switch_info.cur_top_addr)
-	LDR R4,[R4] // Dereference
+	LDR R3,=__cpp(&switch_info.cur_top_addr)
+	LDR R4,[R3] // Dereference
 	STR R2,[R4]
 	
+#if CYMRIC_STACK_CHECK
+	// Check the current task's stack now that its top of stack has been saved.  R4-R11 have been saved, so the 
+	// registers still needed are kept in them across the call; the main stack is untouched, so stays aligned.
+	MOV R5,R2
+	MOV R6,R3
+	MOV R7,LR
+	BL __cpp(prv_stack_check_outgoing)
+	MOV R2,R5
+	MOV R3,R6
+	MOV LR,R7
+#endif
+	
+#if CYMRIC_RUN_STATS
+	// Charge the cycles since the last switch to the current task and count the switch (R4-R11 have been 
+	// saved, so they are free to use).  This is the same as prv_run_stats_update().
+	LDR R5,=__cpp(&switch_info.switch_cycles)
+	LDR R6,=__cpp(&DWT->CYCCNT)
+	LDR R6,[R6]
+	LDR R7,[R5]
+	STR R6,[R5]
+	SUB R6,R6,R7
+	LDRD R8,R9,[R4,#__cpp(TCB_OFFSET(run_cycles))]
+	ADDS R8,R8,R6
+	ADC R9,R9,#0
+	STRD R8,R9,[R4,#__cpp(TCB_OFFSET(run_cycles))]
+	LDR R7,[R4,#__cpp(TCB_OFFSET(switches))]
+	ADD R7,R7,#1
+	STR R7,[R4,#__cpp(TCB_OFFSET(switches))]
+	LDRD R8,R9,[R5,#__cpp(SWITCH_OFFSET(total_cycles))]
+	ADDS R8,R8,R6
+	ADC R9,R9,#0
+	STRD R8,R9,[R5,#__cpp(SWITCH_OFFSET(total_cycles))]
+	LDR R7,[R5,#__cpp(SWITCH_OFFSET(switches))]
+	ADD R7,R7,#1
+	STR R7,[R5,#__cpp(SWITCH_OFFSET(switches))]
+#endif
+	
 	// Set the stack pointer to the top of stack of the new task
 	LDR R4,=__cpp(&switch_info.next_top_addr)
 	LDR R4,[R4] // Dereference
 	LDR R2,[R4]
 	
-	// Pop R4-R11 from the stack
-	LDMFD R2!,{R4-R11}
+	// The new task is now the current one
+	STR R4,[R3]
+	
+#if CYMRIC_MPU_STACK_GUARD
+	// Move the guard region below the new task's stack (R0-R1 are restored from the exception frame).
+	// This is two loads and a store per switch; the exception return synchronizes the MPU update.
+	LDR R0,=__cpp(&switch_info.next_mpu_rbar)
+	LDR R0,[R0]
+	LDR R1,=__cpp(&MPU->RBAR)
+	STR R0,[R1]
+#endif
+	
+	// Pop R4-R11 and EXC_RETURN from the stack
+	LDMFD R2!,{R4-R11,LR}
+	
+#if (__FPU_USED == 1)
+	// Pop S16-S31 if the new task has used the FPU
+	TST LR,#EXC_RETURN_BASIC_FRAME_Msk
+	IT EQ
+	VLDMIAEQ R2!,{S16-S31}
+#endif
 	
 	// Update PSP
 	MSR PSP,R2
 	
-	// Padding, to remove a warning
-	NOP 
+	MOV R0,#0
+	MSR BASEPRI,R0
 	
 	// Return from handler
 	BX LR
 }
 
+#if CYMRIC_TICKLESS_IDLE
+// SysTick cycles per tick, and the most ticks that fit in the SysTick reload register
+static uint32_t s_tick_cycles;
+static uint32_t s_max_idle_ticks;
+
+// Account for ticks that passed while the tick was stopped.  The number of ticks must be less than
+// the number until the next task wakes up.
+static void prv_ticks_skip(uint32_t ticks) {
+	s_ticks_ms += ticks;
+	if(s_sleeping) {
+		s_sleeping->sleep_delta -= ticks;
+	}
+#if CYMRIC_TIMERS
+	cymric_timer_skip(ticks);
+#endif
+	
+	for(uint32_t i = 0; i < ticks; i++) {
+		HAL_IncTick(); // to be removed once unnecessary
+	}
+}
+
+// Restart SysTick so that its next interrupt occurs the number of cycles given from now, 
+// with normal tick periods after that.
+static void prv_tick_restart(uint32_t cycles) {
+	SysTick->LOAD = cycles - 1;
+	SysTick->VAL = 0;
+	SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+	
+	// Only takes effect on the next reload
+	SysTick->LOAD = s_tick_cycles - 1;
+}
+
+// Stop the tick and sleep until the next task is due to wake up (or another interrupt occurs) if no
+// other task is ready to run, then correct the tick count for the time spent asleep.
+static void prv_tickless_idle(void) {
+	uint32_t mask = cymric_critical_enter();
+	
+	// Don't sleep while another task is ready.  Once started, readying a task above the idle priority always 
+	// requests a switch to it, which is carried out as soon as this critical section is left.
+	if(prv_any_ready()) {
+		cymric_critical_exit(mask);
+		return;
+	}
+	
+	uint32_t idle_ticks = s_sleeping ? s_sleeping->sleep_delta : s_max_idle_ticks;
+	if(idle_ticks > s_max_idle_ticks) {
+		idle_ticks = s_max_idle_ticks;
+	}
+	
+#if CYMRIC_TIMERS
+	// Wake up in time to expire the next timer
+	uint32_t timer_ticks = cymric_timer_idle_ticks();
+	if(idle_ticks > timer_ticks) {
+		idle_ticks = timer_ticks;
+	}
+#endif
+	
+	if(idle_ticks < CYMRIC_TICKLESS_MIN_TICKS) {
+		cymric_critical_exit(mask);
+		return;
+	}
+	
+	// Stop SysTick and find how far through the current tick period it is.  If the tick has already
+	// expired, let SysTick_Handler deal with it.
+	SysTick->CTRL &= ~SysTick_CTRL_ENABLE_Msk;
+	uint32_t remaining = SysTick->VAL;
+	if((SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) || remaining == 0) {
+		SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+		cymric_critical_exit(mask);
+		return;
+	}
+	
+	// Interrupt at the tick boundary on which the next task wakes up
+	uint32_t sleep_cycles = remaining + (idle_ticks - 1) * s_tick_cycles;
+	SysTick->LOAD = sleep_cycles - 1;
+	SysTick->VAL = 0;
+	(void)SysTick->CTRL; // Clear COUNTFLAG
+	SysTick->CTRL |= SysTick_CTRL_ENABLE_Msk;
+	
+#if USE_CYCLE_COUNTER
+	uint32_t sleep_start = DWT->CYCCNT;
+#endif
+	
+	// Sleep until an interrupt is pending.  Interrupts masked by the critical section wouldn't wake the processor,
+	// so mask all of them with PRIMASK instead while sleeping.  On waking, those above the kernel's threshold are 
+	// serviced straight away and the rest once the tick count has been corrected.
+	__disable_irq();
+	cymric_critical_exit(mask);
+	__dsb(0xF);
+	__wfi();
+	__isb(0xF);
+	mask = cymric_critical_enter();
+	__enable_irq();
+	
+	// Reading CTRL clears COUNTFLAG, so keep the value read when stopping SysTick.  If SysTick reaches 0 after 
+	// that read, its interrupt is still left pending by the critical section.
+	uint32_t ctrl = SysTick->CTRL;
+	SysTick->CTRL = ctrl & ~SysTick_CTRL_ENABLE_Msk;
+	uint32_t val = SysTick->VAL;
+	uint32_t cycles_into_period;
+#if USE_CYCLE_COUNTER
+	uint32_t slept = (sleep_cycles - 1) - val;
+#endif
+	
+	if((ctrl & SysTick_CTRL_COUNTFLAG_Msk) || (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk)) {
+		// Slept the whole way.  The SysTick interrupt is pending and will count the last tick, 
+		// so only the ticks before it need to be added.
+		prv_ticks_skip(idle_ticks - 1);
+		cycles_into_period = (sleep_cycles - 1) - val;
+#if USE_CYCLE_COUNTER
+		slept += sleep_cycles; // SysTick has reloaded once
+#endif
+	} else {
+		// Woken early by another interrupt.  Add the ticks fully elapsed since the last tick boundary.
+		uint32_t elapsed = (s_tick_cycles - remaining) + ((sleep_cycles - 1) - val);
+		uint32_t ticks = elapsed / s_tick_cycles;
+		if(ticks >= idle_ticks) {
+			ticks = idle_ticks - 1;
+		}
+		prv_ticks_skip(ticks);
+		cycles_into_period = elapsed - ticks * s_tick_cycles;
+	}
+	
+	// Keep the following ticks in phase with the ones before the sleep
+	if(cycles_into_period >= s_tick_cycles - 1) {
+		cycles_into_period = s_tick_cycles - 2;
+	}
+	prv_tick_restart(s_tick_cycles - cycles_into_period);
+	
+#if USE_CYCLE_COUNTER
+	prv_cycle_count_sleep(sleep_start, slept);
+#endif
+	
+	cymric_critical_exit(mask);
+}
+#endif
+
+#if CYMRIC_HEAP
+// Free the memory of tasks from cymric_task_new_heap() which deleted themselves.
+static void prv_heap_reap(void) {
+	uint32_t mask = cymric_critical_enter();
+	while(s_heap_zombies) {
+		CymricTCB *tcb = s_heap_zombies;
+		s_heap_zombies = tcb->next;
+		cymric_heap_free(tcb);
+	}
+	cymric_critical_exit(mask);
+}
+#endif
+
 // Idle task
 static void prv_idle(void *args) {
 	while(1) {
+#if CYMRIC_HEAP
+		prv_heap_reap();
+#endif
+#if CYMRIC_TICKLESS_IDLE
+		prv_tickless_idle();
+#else
 		asm("nop");
+#endif
 	}
 }
 
 bool cymric_init(void) {
 	// Get the base address of the main stack and subtract 
 	uint32_t *main_stack_base_addr = CORTEX_M4_MSP_RST_ADDR;
-	uint32_t *cur_stack_addr = (uint32_t*)*main_stack_base_addr - CYMRIC_MAIN_STACK_SIZE / 4; // 4 bytes in uint32
+	s_stacks_top = (uint32_t*)*main_stack_base_addr - CYMRIC_MAIN_STACK_SIZE / 4; // 4 bytes in uint32
 
 	// Initialize each TCB
 	for(uint8_t i = 0; i < CYMRIC_MAX_TASKS; i++) {
-		
-		// Increment addresses by thread stack size
-		s_tcbs[i].addr = cur_stack_addr;
+		prv_pool_stack_assign(&s_tcbs[i]);
 		
 		// Top of stack initializes to the same address as base
-		s_tcbs[i].top_addr = cur_stack_addr;
-		
-		// Decrement for next TCB
-		cur_stack_addr -= CYMRIC_THREAD_STACK_SIZE / 4; // 4 bytes in uint32
+		s_tcbs[i].top_addr = s_tcbs[i].addr;
 	}
+	s_free_tcbs = NULL;
+	
+	// Scheduling decisions before starting treat the idle task as running
+	switch_info.cur_tcb = &s_tcbs[CYMRIC_IDLE_ID];
 	
 	// First ID which application tasks can be allocated to
 	s_cur_alloc_id = CYMRIC_IDLE_ID + 1;
@@ -186,66 +938,419 @@ bool cymric_init(void) {
 	NVIC_SetPriority(SysTick_IRQn, CYMRIC_SYSTICK_PRIORITY);
 	NVIC_SetPriority(PendSV_IRQn, CYMRIC_PENDSV_PRIORITY);
 	
+#if CYMRIC_TIMERS
+	if(!cymric_timer_service_init()) {
+		return false;
+	}
+#endif
+	
 	return true;
 }
 
 void cymric_start(void) {
+#if CYMRIC_MPU_STACK_GUARD
+	// Guard the idle task's stack, which runs first
+	prv_stack_guard_init(&s_tcbs[CYMRIC_IDLE_ID]);
+	prv_stack_guard_start(&s_tcbs[CYMRIC_IDLE_ID]);
+#endif
+	
+#if CYMRIC_STACK_CHECK
+	// Paint the idle task's stack while still running on the main stack
+	prv_stack_paint(s_tcbs[CYMRIC_IDLE_ID].stack_limit, s_tcbs[CYMRIC_IDLE_ID].addr);
+#endif
+	
 	// Reset MSP to main stack base address
 	uint32_t *main_stack_base_addr = CORTEX_M4_MSP_RST_ADDR;
 	__set_MSP(*main_stack_base_addr);
 	
-	// Switch from MSP to PSP
+	// Switch from MSP to PSP.  Also clear any FP context from before starting, so that the idle task
+	// doesn't carry around an extended frame.
 	uint32_t control = __get_CONTROL();
 	control |= CONTROL_SPSEL_Msk;
+	control &= ~CONTROL_FPCA_Msk;
 	__set_CONTROL(control);
 	
 	// Change PSP to the address of the idle task
 	__set_PSP((uint32_t)s_tcbs[CYMRIC_IDLE_ID].addr);
 	
+	// The idle task is the first one running
+	s_tcbs[CYMRIC_IDLE_ID].id = CYMRIC_IDLE_ID;
+	s_tcbs[CYMRIC_IDLE_ID].pri = CYMRIC_PRI_IDLE;
+	s_tcbs[CYMRIC_IDLE_ID].base_pri = CYMRIC_PRI_IDLE;
+	s_tcbs[CYMRIC_IDLE_ID].slice_ms = CYMRIC_SLICE_NONE; // Only runs when nothing else can
+	s_tcbs[CYMRIC_IDLE_ID].state = CYMRIC_TASK_STATE_RUNNING;
+	switch_info.cur_tcb = &s_tcbs[CYMRIC_IDLE_ID];
+	switch_info.cur_top_addr = &s_tcbs[CYMRIC_IDLE_ID].top_addr;
+	
 	// Configure systick
 	s_ticks_ms = 0;
+#if CYMRIC_TICKLESS_IDLE
+	s_tick_cycles = SysTick->LOAD + 1;
+	s_max_idle_ticks = SysTick_LOAD_RELOAD_Msk / s_tick_cycles;
+#endif
+	
+#if USE_CYCLE_COUNTER
+	// Start the cycle counter, with cycles from here on charged to the idle task
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#if CYMRIC_RUN_STATS
+	switch_info.switch_cycles = 0;
+#endif
+#endif
 	s_started_flag = true;
 	
+	// Tasks created before starting were only made ready, so switch to the highest-priority one.  The switch
+	// happens as the critical section is left.
+	uint32_t mask = cymric_critical_enter();
+	prv_preempt();
+	cymric_critical_exit(mask);
+	
 	// Invoke idle task function
 	//s_cur_alloc_id++;
-	prv_insert(&s_tcbs[CYMRIC_IDLE_ID], CYMRIC_PRI_IDLE);
 	prv_idle(0);
 }
 
-bool cymric_task_new(CymricTaskFunction func, void *args, CymricPriority pri) {
-	if(s_cur_alloc_id >= CYMRIC_MAX_TASKS) return false;
+// Get one of the RTOS's TCBs which isn't in use, or NULL if there are none left.
+// Must be called in a critical section.
+static CymricTCB *prv_tcb_alloc(void) {
+	// Reuse TCBs from deleted tasks first
+	CymricTCB *tcb = s_free_tcbs;
+	if(tcb) {
+		s_free_tcbs = tcb->next;
+	} else if(s_cur_alloc_id < CYMRIC_MAX_TASKS) {
+		tcb = &s_tcbs[s_cur_alloc_id];
+		tcb->id = s_cur_alloc_id++;
+	}
+	return tcb;
+}
+
+// Tasks return here when their function returns.
+static void prv_task_exit(void) {
+	cymric_task_delete(NULL);
 	
-	// Configure initial registers for future context switching
-	uint32_t *addr = s_tcbs[s_cur_alloc_id].addr;
+	// Only reached if the task couldn't be deleted because it still owns a mutex
+	while(1) {
+		cymric_delay(CYMRIC_TIMEOUT_FOREVER);
+	}
+}
+
+// Set up a TCB whose stack has been assigned and make it ready to run func(args) at the priority given.
+// Must be called in a critical section.
+static void prv_task_init(CymricTCB *tcb, CymricTaskFunction func, void *args, CymricPriority pri) {
+	// Configure initial registers for future context switching.  The stack grows down from addr.
+	uint32_t *addr = tcb->addr;
 	
 	// PSR
-	*addr = PSR_DEFAULT;
 	addr--;
+	*addr = PSR_DEFAULT;
 	
 	// PC - address of function
+	addr--;
 	*addr = (uint32_t)func;
 	
-	// R0 - address of args (located 6 indices below PC)
-	addr -= 6;
+	// LR - where the function returns to
+	addr--;
+	*addr = (uint32_t)&prv_task_exit;
+	
+	// R0 - address of args (located 5 indices below LR)
+	addr -= 5;
 	*addr = (uint32_t)args;
 	
-	// Top of stack is 8 indices below R0 for the other 8 registers stored
-	s_tcbs[s_cur_alloc_id].top_addr = addr - 8;
+	// EXC_RETURN is stored 1 index below R0, so the task starts with a basic frame and no FP context
+	addr--;
+	*addr = EXC_RETURN_THREAD_PSP;
+	
+	// Top of stack is 8 indices below EXC_RETURN for the other 8 registers stored
+	tcb->top_addr = addr - 8;
 	
-	// Update ID
-	s_tcbs[s_cur_alloc_id].id = s_cur_alloc_id;
+#if CYMRIC_MPU_STACK_GUARD
+	prv_stack_guard_init(tcb);
+#endif
+	
+#if CYMRIC_STACK_CHECK
+	// Paint the rest of the stack so its usage can be measured
+	prv_stack_paint(tcb->stack_limit, tcb->top_addr);
+#endif
 	
 	// Update priority and insert
-	s_tcbs[s_cur_alloc_id].pri = pri;
-	prv_insert(&s_tcbs[s_cur_alloc_id], pri);
+	tcb->pri = pri;
+	tcb->base_pri = pri;
+	tcb->slice_ms = CYMRIC_SCHED_INT_MS;
+	tcb->wait_list = NULL;
+	tcb->wait_data = NULL;
+	tcb->owned = NULL;
+	tcb->sleep_next = NULL;
+	tcb->sleep_pprev = NULL;
+	tcb->notify_count = 0;
+	tcb->notify_waiter = (CymricWaitList){ .head = NULL, .owner = NULL };
+#if CYMRIC_HEAP
+	tcb->heap = false;
+#endif
+#if CYMRIC_RUN_STATS
+	tcb->run_cycles = 0;
+	tcb->switches = 0;
+#endif
+	CYMRIC_EVENT_TASK_CREATE(tcb);
+	
+	// Runs immediately if created by a lower-priority task after the RTOS has started
+	prv_ready(tcb);
+}
+
+CymricTask *cymric_task_new(CymricTaskFunction func, void *args, CymricPriority pri) {
+#if NUM_CYMRIC_PRIORITIES < 256 // Otherwise every CymricPriority is valid
+	if(pri >= NUM_CYMRIC_PRIORITIES) return NULL;
+#endif
+	
+	uint32_t mask = cymric_critical_enter();
+	CymricTCB *tcb = prv_tcb_alloc();
+	if(!tcb) {
+		cymric_critical_exit(mask);
+		return NULL;
+	}
+	
+	// The TCB's stack may have been replaced if it was last used by cymric_task_new_static()
+	prv_pool_stack_assign(tcb);
+	
+	prv_task_init(tcb, func, args, pri);
+	cymric_critical_exit(mask); // Context switch occurs here if needed
+	
+	return tcb;
+}
+
+CymricTask *cymric_task_new_static(CymricTaskFunction func, void *args, CymricPriority pri, 
+		void *stack, uint32_t stack_size, CymricTask *tcb) {
+#if NUM_CYMRIC_PRIORITIES < 256 // Otherwise every CymricPriority is valid
+	if(pri >= NUM_CYMRIC_PRIORITIES) return NULL;
+#endif
+	if(!stack || stack_size < CYMRIC_MIN_STACK_SIZE) return NULL;
+	
+	uint32_t mask = cymric_critical_enter();
+	if(tcb) {
+		if(!prv_id_alloc(tcb)) {
+			cymric_critical_exit(mask);
+			return NULL;
+		}
+	} else {
+		// Use one of the RTOS's TCBs, leaving its stack unused
+		tcb = prv_tcb_alloc();
+		if(!tcb) {
+			cymric_critical_exit(mask);
+			return NULL;
+		}
+	}
+	
+	// Word-align the bottom of the stack and 8-byte-align the top, as required for exception frames
+	tcb->stack_limit = (uint32_t*)(((uint32_t)stack + 3) & ~3ul);
+	tcb->addr = (uint32_t*)(((uint32_t)stack + stack_size) & ~7ul);
+	
+	prv_task_init(tcb, func, args, pri);
+	cymric_critical_exit(mask); // Context switch occurs here if needed
+	
+	return tcb;
+}
+
+#if CYMRIC_HEAP
+CymricTask *cymric_task_new_heap(CymricTaskFunction func, void *args, CymricPriority pri, uint32_t stack_size) {
+#if NUM_CYMRIC_PRIORITIES < 256 // Otherwise every CymricPriority is valid
+	if(pri >= NUM_CYMRIC_PRIORITIES) return NULL;
+#endif
+	if(stack_size < CYMRIC_MIN_STACK_SIZE) return NULL;
+	
+	// Reclaim the memory of deleted tasks first
+	prv_heap_reap();
+	
+	// The stack goes after the TCB in the same block, 8-byte aligned
+	uint32_t tcb_size = (sizeof(CymricTCB) + 7) & ~7ul;
+	uint8_t *block = cymric_heap_alloc(tcb_size + stack_size);
+	if(!block) return NULL;
+	
+	uint32_t mask = cymric_critical_enter();
+	CymricTCB *tcb = (CymricTCB*)block;
+	if(!prv_id_alloc(tcb)) {
+		cymric_critical_exit(mask);
+		cymric_heap_free(block);
+		return NULL;
+	}
+	tcb->stack_limit = (uint32_t*)(block + tcb_size);
+	tcb->addr = (uint32_t*)(((uint32_t)block + tcb_size + stack_size) & ~7ul);
+	
+	prv_task_init(tcb, func, args, pri);
+	tcb->heap = true;
+	cymric_critical_exit(mask); // Context switch occurs here if needed
+	
+	return tcb;
+}
+#endif
+
+bool cymric_task_delete(CymricTask *task) {
+	uint32_t mask = cymric_critical_enter();
+	if(!task) {
+		task = switch_info.cur_tcb;
+	}
+	
+	// The idle task must always exist, and deleting a task which owns a mutex would leave it taken forever
+	if(task == &s_tcbs[CYMRIC_IDLE_ID] || task->state == CYMRIC_TASK_STATE_DELETED || task->owned) {
+		cymric_critical_exit(mask);
+		return false;
+	}
+	
+	// Remove the task from any list it is in
+	bool self = (task->state == CYMRIC_TASK_STATE_RUNNING);
+	if(task->state == CYMRIC_TASK_STATE_READY) {
+		prv_ready_remove(task);
+	} else if(task->state == CYMRIC_TASK_STATE_BLOCKED) {
+		prv_sleep_remove(task);
+		if(task->wait_list) {
+			prv_wait_remove(task);
+		}
+	}
+	task->state = CYMRIC_TASK_STATE_DELETED;
+	CYMRIC_EVENT_TASK_DELETE(task);
+	
+	// Recycle the TCB (and with it, its stack) if it is one of the RTOS's.  This is safe even when the calling 
+	// task is deleting itself, since no other task can run to reuse them until the context switch away from it.
+	if(task >= s_tcbs && task < &s_tcbs[CYMRIC_MAX_TASKS]) {
+		task->next = s_free_tcbs;
+		s_free_tcbs = task;
+	} else {
+		prv_id_free(task);
+	}
+	
+#if CYMRIC_HEAP
+	// Free the memory of a task from the heap, unless it is still running on its stack
+	if(task->heap) {
+		if(self) {
+			task->next = s_heap_zombies;
+			s_heap_zombies = task;
+		} else {
+			cymric_heap_free(task);
+		}
+	}
+#endif
+	
+	if(self) {
+		prv_schedule(CYMRIC_TRACE_DELETE);
+		prv_switch_point(); // Never returns
+	}
+	cymric_critical_exit(mask);
 	
-	s_cur_alloc_id++;
 	return true;
 }
 
+#if CYMRIC_STACK_CHECK
+uint32_t cymric_task_stack_high_water(CymricTask *task) {
+	if(!task) {
+		task = switch_info.cur_tcb;
+	}
+	
+	// Find the lowest word which has been written to
+	uint32_t *addr = task->stack_limit;
+	while(addr < task->addr && *addr == CYMRIC_STACK_PAINT) {
+		addr++;
+	}
+	return (task->addr - addr) * 4; // 4 bytes in uint32
+}
+#endif
+
+#if CYMRIC_RUN_STATS
+void cymric_task_stats(CymricTask *task, CymricTaskStats *stats) {
+	uint32_t mask = cymric_critical_enter();
+	if(!task) {
+		task = switch_info.cur_tcb;
+	}
+	
+	// Bring the running task's count up to date
+	if(s_started_flag) {
+		prv_run_stats_update();
+	}
+	stats->run_cycles = task->run_cycles;
+	stats->switches = task->switches;
+	cymric_critical_exit(mask);
+}
+
+void cymric_stats(CymricStats *stats) {
+	uint32_t mask = cymric_critical_enter();
+	if(s_started_flag) {
+		prv_run_stats_update();
+	}
+	stats->total_cycles = switch_info.total_cycles;
+	stats->idle_cycles = s_tcbs[CYMRIC_IDLE_ID].run_cycles;
+	stats->switches = switch_info.switches;
+	cymric_critical_exit(mask);
+	
+	stats->idle_percent = stats->total_cycles ? (uint32_t)(stats->idle_cycles * 100 / stats->total_cycles) : 0;
+}
+#endif
+
+void cymric_task_set_slice(CymricTask *task, uint32_t slice_ms) {
+	uint32_t mask = cymric_critical_enter();
+	if(!task) {
+		task = switch_info.cur_tcb;
+	}
+	task->slice_ms = slice_ms;
+	task->slice_left_ms = slice_ms;
+	cymric_critical_exit(mask);
+}
+
+// Give a task a notification.  Must be called in a critical section.
+static void prv_notify(CymricTCB *tcb) {
+	if(tcb->state != CYMRIC_TASK_STATE_DELETED) {
+		tcb->notify_count++;
+		cymric_wake(&tcb->notify_waiter);
+	}
+}
+
+void cymric_task_notify(CymricTask *task) {
+	uint32_t mask = cymric_critical_enter();
+	prv_notify(task);
+	cymric_critical_exit(mask); // Context switch occurs here if needed
+}
+
+void cymric_task_notify_from_isr(CymricTask *task) {
+	uint32_t mask = cymric_isr_lock();
+	prv_notify(task);
+	cymric_isr_unlock(mask);
+}
+
+uint32_t cymric_task_notify_wait(uint32_t timeout_ms) {
+	uint32_t mask = cymric_critical_enter();
+	CymricTCB *cur = switch_info.cur_tcb;
+	
+	// Sleep until a notification is given, unless one already has been
+	if(!cur->notify_count) {
+		cymric_block(&cur->notify_waiter, timeout_ms);
+	}
+	
+	uint32_t count = cur->notify_count;
+	cur->notify_count = 0;
+	cymric_critical_exit(mask);
+	
+	return count;
+}
+
 void cymric_delay(uint32_t delay_ms) {
-	uint32_t want = s_ticks_ms + delay_ms;
-	while(s_ticks_ms < want) {}
+	if(!s_started_flag) {
+		// No other tasks can run yet, so just wait for the ticks to pass
+		uint32_t start_ms = s_ticks_ms;
+		while(s_ticks_ms - start_ms < delay_ms) {}
+		return;
+	}
+	
+	if(delay_ms == 0) {
+		cymric_thread_yield();
+		return;
+	}
+	
+	// Park the current task on the sleep queue until SysTick_Handler wakes it back up
+	uint32_t mask = cymric_critical_enter();
+	CymricTCB *cur = switch_info.cur_tcb;
+	cur->state = CYMRIC_TASK_STATE_BLOCKED;
+	prv_sleep_insert(cur, delay_ms);
+	CYMRIC_EVENT_TASK_DELAY(cur, delay_ms);
+	prv_schedule(CYMRIC_TRACE_BLOCK);
+	prv_switch_point();
+	cymric_critical_exit(mask);
 }
 
 uint32_t cymric_get_ticks(void) {
@@ -254,5 +1359,102 @@ uint32_t cymric_get_ticks(void) {
 
 void cymric_thread_yield(void) {
 	// Just run the scheduler early to push the thread back to the end of the line
-	prv_schedule();
+	uint32_t mask = cymric_critical_enter();
+	prv_schedule(CYMRIC_TRACE_YIELD);
+	cymric_critical_exit(mask);
+}
+
+uint32_t cymric_critical_enter(void) {
+	uint32_t mask = __get_BASEPRI();
+	
+	// Only raises the mask, so an outer critical section's mask is never lowered
+	__set_BASEPRI_MAX(KERNEL_BASEPRI);
+	__dsb(0xF);
+	__isb(0xF);
+	return mask;
+}
+
+void cymric_critical_exit(uint32_t mask) {
+	__set_BASEPRI(mask);
+	__isb(0xF); // Take any interrupt (e.g. a pended PendSV) just unmasked before carrying on
+}
+
+uint32_t cymric_isr_lock(void) {
+	uint32_t mask = cymric_critical_enter();
+	s_defer_schedule = true;
+	return mask;
+}
+
+void cymric_isr_unlock(uint32_t mask) {
+	s_defer_schedule = false;
+	cymric_critical_exit(mask);
+}
+
+struct CymricTCB *cymric_cur_tcb(void) {
+	return s_started_flag ? switch_info.cur_tcb : NULL;
+}
+
+bool cymric_block(CymricWaitList *list, uint32_t timeout_ms) {
+	// Can't wait if there are no other tasks to switch to
+	if(!s_started_flag || timeout_ms == 0) {
+		return false;
+	}
+	
+	CymricTCB *cur = switch_info.cur_tcb;
+	cur->state = CYMRIC_TASK_STATE_BLOCKED;
+	cur->timed_out = false;
+	prv_wait_insert(list, cur);
+	prv_update_owner(list); // Owner inherits the waiter's priority if it is higher
+	if(timeout_ms != CYMRIC_TIMEOUT_FOREVER) {
+		prv_sleep_insert(cur, timeout_ms);
+	}
+	CYMRIC_EVENT_TASK_BLOCK(cur, timeout_ms);
+	prv_schedule(CYMRIC_TRACE_BLOCK);
+	
+	// Execution resumes here once the task is woken or its timeout expires
+	prv_switch_point();
+	
+	return !cur->timed_out;
+}
+
+struct CymricTCB *cymric_wake(CymricWaitList *list) {
+	if(!list->head) {
+		return NULL;
+	}
+	return cymric_wake_at(list, &list->head);
+}
+
+struct CymricTCB *cymric_wake_at(CymricWaitList *list, struct CymricTCB **link) {
+	CymricTCB *tcb = *link;
+	*link = tcb->next;
+	tcb->wait_list = NULL;
+	prv_update_owner(list);
+	prv_sleep_remove(tcb);
+	CYMRIC_EVENT_TASK_UNBLOCK(tcb, false);
+	prv_ready(tcb);
+	
+	return tcb;
+}
+
+void cymric_set_owner(CymricWaitList *list, struct CymricTCB *owner) {
+	// Disown from the previous owner, dropping any priority it inherited through this object
+	CymricTCB *prev = list->owner;
+	if(prev) {
+		for(CymricWaitList **cur = &prev->owned; *cur; cur = &(*cur)->next_owned) {
+			if(*cur == list) {
+				*cur = list->next_owned;
+				break;
+			}
+		}
+		list->owner = NULL;
+		prv_set_pri(prev, prv_inherited_pri(prev));
+	}
+	
+	// The new owner inherits the priority of any remaining waiters
+	if(owner) {
+		list->owner = owner;
+		list->next_owned = owner->owned;
+		owner->owned = list;
+		prv_set_pri(owner, prv_inherited_pri(owner));
+	}
 }
@@ -1,4 +1,6 @@
 // WIP RTOS
+#pragma once
+
 #include <inttypes.h>
 #include <stdbool.h>
 
@@ -8,14 +10,77 @@
 // ID of the idle task
 #define CYMRIC_IDLE_ID 0
 
-// Interval to perform scheduling on
+// Default time slice given to a task before it is rotated with other tasks at its priority
 #define CYMRIC_SCHED_INT_MS 5
 
+// Time slice that disables time slicing for a task, so it runs until it blocks, yields or is pre-empted
+#define CYMRIC_SLICE_NONE 0
+
+// Whether the idle task should stop the periodic tick and sleep until the next task wakes up when
+// no other task is ready to run
+#define CYMRIC_TICKLESS_IDLE 1
+
+// Minimum number of ticks that the idle task must be able to sleep for before the tick is stopped
+#define CYMRIC_TICKLESS_MIN_TICKS 2
+
+// Whether task stacks are painted when created so that their usage can be measured, and checked
+// for overflow on each context switch
+#define CYMRIC_STACK_CHECK 1
+
+// Value task stacks are painted with
+#define CYMRIC_STACK_PAINT 0xA5A5A5A5
+
+// Whether the lowest 32-byte-aligned block of each task's stack is made inaccessible using the MPU while
+// the task runs, so that overflowing it faults immediately
+#define CYMRIC_MPU_STACK_GUARD 0
+
+// MPU region used for the stack guard (the highest-numbered region takes precedence over the others)
+#define CYMRIC_MPU_GUARD_REGION 7
+
+// Whether the processor cycles spent running each task are counted using the DWT cycle counter, along with
+// the number of context switches
+#define CYMRIC_RUN_STATS 0
+
+// Whether context switches are recorded in the cymric_trace ring buffer, which can be decoded from a RAM dump
+// with tools/trace_decode.py
+#define CYMRIC_TRACE 0
+
+// Number of context switches kept in the trace buffer (must be a power of 2)
+#define CYMRIC_TRACE_SIZE 256
+
+// Value at the start of the trace buffer, so that it can be found in a RAM dump ("CYTR")
+#define CYMRIC_TRACE_MAGIC 0x52545943
+
+// Whether software timers (see cymric_timer.h) are available.  Their callbacks run in a timer task, which takes
+// up one of the CYMRIC_MAX_TASKS tasks.
+#define CYMRIC_TIMERS 0
+
+// Priority of the timer task
+#define CYMRIC_TIMER_TASK_PRI CYMRIC_PRI_HIGH
+
+// Whether the real-time heap (see cymric_heap.h) is available, along with cymric_task_new_heap()
+#define CYMRIC_HEAP 0
+
+// Tracing tools that kernel events (see cymric_events.h) can be recorded with
+#define CYMRIC_EVENTS_NONE 0
+#define CYMRIC_EVENTS_EVENT_RECORDER 1 // Keil Event Recorder
+#define CYMRIC_EVENTS_SYSTEMVIEW 2 // SEGGER SystemView
+
+// Tracing tool to record kernel events with
+#define CYMRIC_EVENTS CYMRIC_EVENTS_NONE
+
+// Event Recorder component number of kernel events (0x00-0x3F are available to applications)
+#define CYMRIC_EVENTS_COMPONENT 0x3C
+
 // Max value of a uint32_t
 #define CYMRIC_TIMEOUT_FOREVER 0xFFFFFFFF
 
 // Size of task threads (in bytes)
 #define CYMRIC_THREAD_STACK_SIZE 1024
+
+// Minimum size of a stack passed to cymric_task_new_static() (in bytes), enough to hold an initial frame
+// and an FP context switch
+#define CYMRIC_MIN_STACK_SIZE 256
 #define CYMRIC_MAIN_STACK_SIZE 2048
 
 // Location of reset value of the main stack pointer (see p.g. 17 of Cortex-M4 Generic User Guide)
@@ -24,19 +89,154 @@
 // PSR default address
 #define PSR_DEFAULT 0x01000000
 
-// Highest priority
-#define CYMRIC_SYSTICK_PRIORITY 0x00
+// EXC_RETURN value to return to thread mode using the PSP, with a basic (non-FP) exception frame.
+// Bit 4 is cleared by the processor when the frame is extended with FP registers.
+#define EXC_RETURN_THREAD_PSP 0xFFFFFFFD
+#define EXC_RETURN_BASIC_FRAME_Msk 0x10
+
+// Highest interrupt priority (lowest NVIC priority number) masked by the kernel's critical sections.  Interrupts 
+// at this priority or below may call the kernel's _from_isr functions.  Those above it are never delayed by the 
+// kernel but must not call it.  Must be at least 1, as BASEPRI can't mask priority 0.
+#define CYMRIC_KERNEL_IRQ_PRIORITY 5
+
+// Highest priority that is masked by the kernel's critical sections, since SysTick_Handler updates the kernel's state
+#define CYMRIC_SYSTICK_PRIORITY CYMRIC_KERNEL_IRQ_PRIORITY
 
 // Lowest priority, to avoid nested interrupts affecting the stack
 #define CYMRIC_PENDSV_PRIORITY 0xFF
 
-typedef enum {
+// Number of task priorities, up to 256.  Priorities range from 0 (idle) to NUM_CYMRIC_PRIORITIES - 1,
+// with higher values being higher priorities.
+#define NUM_CYMRIC_PRIORITIES 4
+
+// Task priority
+typedef uint8_t CymricPriority;
+
+// Named priority levels (any value below NUM_CYMRIC_PRIORITIES can also be used)
+enum {
 	CYMRIC_PRI_IDLE = 0,
 	CYMRIC_PRI_LOW,
 	CYMRIC_PRI_MED,
 	CYMRIC_PRI_HIGH,
-	NUM_CYMRIC_PRIORITIES,
-} CymricPriority;
+};
+
+// List of tasks blocked on a kernel object, ordered by priority (highest first) unless fifo is set.
+// Managed by the kernel; should only be zero-initialized by users.
+typedef struct CymricWaitList {
+	struct CymricTCB *head;
+	bool fifo; // Queue waiters in arrival order instead of by priority (not supported for owned objects)
+	struct CymricTCB *owner; // Task owning the object, which inherits the priority of its waiters (NULL if none)
+	struct CymricWaitList *next_owned; // Next object owned by the same task
+	CymricPriority ceiling; // Minimum priority of the owner while it owns the object
+} CymricWaitList;
+
+// Task states
+typedef enum {
+	CYMRIC_TASK_STATE_READY = 0, // Waiting in a ready list
+	CYMRIC_TASK_STATE_RUNNING, // Currently selected to run
+	CYMRIC_TASK_STATE_BLOCKED, // Not runnable until woken (sleeping or waiting on a wait list)
+	CYMRIC_TASK_STATE_DELETED, // Deleted; the TCB is free to be reused
+	NUM_CYMRIC_TASK_STATES,
+} CymricTaskState;
+
+// Only functions ending in _from_isr may be called from interrupt handlers.  They never switch tasks themselves;
+// any context switch they make necessary is decided and carried out by PendSV_Handler once the handler returns.
+
+// Task control block definition.  Only public so that TCBs can be allocated by the application for
+// cymric_task_new_static(); its contents are managed by the kernel.
+typedef struct CymricTCB {
+	uint8_t id;
+	uint32_t *addr; // Base address of task stack
+	uint32_t *top_addr; // Address of top of task stack
+	uint32_t *stack_limit; // Lowest address of task stack
+#if CYMRIC_MPU_STACK_GUARD
+	uint32_t mpu_rbar; // MPU RBAR value selecting the guard region below stack_limit
+#endif
+	CymricPriority pri; // Effective priority, including any inherited priority
+	CymricPriority base_pri; // Priority assigned to the task
+	CymricTaskState state;
+	uint32_t slice_ms; // Time slice given each time the task is switched to (CYMRIC_SLICE_NONE to disable)
+	uint32_t slice_left_ms; // Time left in the current slice
+	struct CymricTCB *next; // For use in linked-list implementation
+	
+	// Sleep queue linkage
+	struct CymricTCB *sleep_next;
+	struct CymricTCB **sleep_pprev; // Pointer to the pointer to this TCB in the sleep queue (NULL if not in it)
+	uint32_t sleep_delta; // Ticks after the previous TCB in the sleep queue to wake up at
+	
+	// Wait list the task is blocked on (if any).  The task is linked into it through next.
+	CymricWaitList *wait_list;
+	bool timed_out; // Whether the last block ended because of a timeout
+	void *wait_data; // Data handed over by or to the task that wakes it (e.g. a queue item)
+	
+	// Objects owned by the task, whose waiters' priorities it inherits
+	CymricWaitList *owned;
+	
+	// Notifications given to the task and not yet received, and the task itself while it waits for one
+	uint32_t notify_count;
+	CymricWaitList notify_waiter;
+	
+#if CYMRIC_HEAP
+	bool heap; // Whether the TCB and stack were allocated from the heap by cymric_task_new_heap()
+#endif
+	
+#if CYMRIC_RUN_STATS
+	uint64_t run_cycles; // Cycles spent running the task, up to when it was last accounted for
+	uint32_t switches; // Number of context switches away from the task
+#endif
+} CymricTCB;
+
+// Handle to a task.
+typedef CymricTCB CymricTask;
+
+#if CYMRIC_RUN_STATS
+// Run-time statistics of a task.
+typedef struct {
+	uint64_t run_cycles; // Processor cycles spent running the task, including interrupts which occurred while it ran
+	uint32_t switches; // Number of context switches away from the task
+} CymricTaskStats;
+
+// Run-time statistics of the RTOS as a whole.
+typedef struct {
+	uint64_t total_cycles; // Processor cycles since the RTOS was started
+	uint64_t idle_cycles; // Processor cycles spent in the idle task
+	uint32_t idle_percent; // Percentage of total_cycles spent in the idle task
+	uint32_t switches; // Number of context switches
+} CymricStats;
+#endif
+
+// Reasons for a context switch, as recorded in the trace buffer
+typedef enum {
+	CYMRIC_TRACE_TICK = 0, // The running task's time slice ran out
+	CYMRIC_TRACE_YIELD, // The running task yielded
+	CYMRIC_TRACE_BLOCK, // The running task delayed or blocked on an object
+	CYMRIC_TRACE_WAKE, // A higher-priority task was woken up or created
+	CYMRIC_TRACE_PREEMPT, // A task's priority changed so that another task should run
+	CYMRIC_TRACE_DELETE, // The running task was deleted
+	NUM_CYMRIC_TRACE_REASONS,
+} CymricTraceReason;
+
+#if CYMRIC_TRACE
+// A context switch recorded in the trace buffer.
+typedef struct {
+	uint32_t timestamp; // DWT->CYCCNT when the switch was requested
+	uint8_t reason; // CymricTraceReason
+	uint8_t from_id; // ID of the task switched from
+	uint8_t to_id; // ID of the task switched to
+	uint8_t to_pri; // Effective priority of the task switched to
+} CymricTraceEvent;
+
+// Ring buffer of the last CYMRIC_TRACE_SIZE context switches.  Only written by the kernel with interrupts
+// disabled; readers can tell that an event was overwritten while reading it from count changing.
+typedef struct {
+	uint32_t magic; // CYMRIC_TRACE_MAGIC
+	uint32_t size; // CYMRIC_TRACE_SIZE
+	volatile uint32_t count; // Total number of events recorded.  The last one is at (count - 1) % size.
+	CymricTraceEvent events[CYMRIC_TRACE_SIZE];
+} CymricTrace;
+
+extern CymricTrace cymric_trace;
+#endif
 
 // Thread function definition.
 typedef void (*CymricTaskFunction)(void *args);
@@ -47,8 +247,78 @@ bool cymric_init(void);
 // Start the RTOS.  This function transforms into the idle task and, as such, is blocking.
 void cymric_start(void);
 
-// Create a new task with the function pointer, arguments, and priority specified.  Returns true if successful, false otherwise.
-bool cymric_task_new(CymricTaskFunction func, void *args, CymricPriority pri);
+// Create a new task with the function pointer, arguments, and priority specified.  Returns a handle to the task if successful, 
+// NULL otherwise (including if the priority is not below NUM_CYMRIC_PRIORITIES).
+CymricTask *cymric_task_new(CymricTaskFunction func, void *args, CymricPriority pri);
+
+// Create a new task like cymric_task_new(), but running on the stack buffer given (of stack_size bytes, at least 
+// CYMRIC_MIN_STACK_SIZE) instead of one of the RTOS's CYMRIC_THREAD_STACK_SIZE stacks.  If tcb is non-NULL it is used 
+// to hold the task's state, in which case the task doesn't count towards CYMRIC_MAX_TASKS (up to 
+// 256 - CYMRIC_MAX_TASKS such tasks, including those from cymric_task_new_heap(), can exist at once).  The stack and 
+// TCB must remain valid for as long as the task exists.  Returns a handle to the task if successful, NULL otherwise.
+CymricTask *cymric_task_new_static(CymricTaskFunction func, void *args, CymricPriority pri, 
+		void *stack, uint32_t stack_size, CymricTask *tcb);
+
+#if CYMRIC_HEAP
+// Create a new task like cymric_task_new(), but with its TCB and a stack of stack_size bytes (at least 
+// CYMRIC_MIN_STACK_SIZE) allocated from the heap, which must have been initialized with cymric_heap_init().  The
+// task doesn't count towards CYMRIC_MAX_TASKS, and its memory is freed when it is deleted (by the idle task, if it 
+// deletes itself).  Returns a handle to the task if successful, NULL otherwise.
+CymricTask *cymric_task_new_heap(CymricTaskFunction func, void *args, CymricPriority pri, uint32_t stack_size);
+#endif
+
+// Delete a task (or the calling task if NULL), which no longer runs.  Tasks are also deleted automatically when their
+// function returns.  TCBs and stacks belonging to the RTOS are reused by future tasks; those passed to 
+// cymric_task_new_static() can be reused by the application once this returns (or, when a task deletes itself, once 
+// another task runs).  Must be called from a task.  Returns false if the task is the idle task, has already been 
+// deleted, or still holds a mutex, true otherwise.
+bool cymric_task_delete(CymricTask *task);
+
+#if CYMRIC_STACK_CHECK
+// Returns the most stack that a task (or the calling task if NULL) has used so far, in bytes.
+uint32_t cymric_task_stack_high_water(CymricTask *task);
+#endif
+
+#if CYMRIC_STACK_CHECK || CYMRIC_MPU_STACK_GUARD
+// Called in a critical section when a context switch finds that a task's stack has overflowed, or
+// when the task overflows into its MPU guard region.  Halts by default; define this function in the 
+// application to override it.
+void cymric_stack_overflow_hook(CymricTask *task);
+#endif
+
+#if CYMRIC_RUN_STATS
+// Get the run-time statistics of a task (or of the calling task if NULL) so far.  Divide cycle counts by 
+// SystemCoreClock to convert them to seconds.
+void cymric_task_stats(CymricTask *task, CymricTaskStats *stats);
+
+// Get the run-time statistics of the RTOS since it was started.
+void cymric_stats(CymricStats *stats);
+#endif
+
+// Set the time slice of a task (or of the calling task if NULL), in ms.  The slice is restarted each time the task is
+// switched to.  Pass in CYMRIC_SLICE_NONE to disable time slicing for the task.  Tasks start with CYMRIC_SCHED_INT_MS.
+void cymric_task_set_slice(CymricTask *task, uint32_t slice_ms);
+
+// Give a task a notification, waking it if it is waiting for one.  Notifications are counted until received.
+void cymric_task_notify(CymricTask *task);
+
+// Version of cymric_task_notify() that can be called from interrupt handlers.
+void cymric_task_notify_from_isr(CymricTask *task);
+
+// Wait for the calling task to be given a notification, or until the timeout expires.  Pass in 
+// CYMRIC_TIMEOUT_FOREVER to wait indefinitely.  Returns the number of notifications received (all of those
+// given since the last call), or 0 if the wait timed out.
+uint32_t cymric_task_notify_wait(uint32_t timeout_ms);
+
+// Enter a critical section, masking all interrupts which may call the kernel (those at CYMRIC_KERNEL_IRQ_PRIORITY 
+// or below).  Critical sections can be nested.  Returns the previous mask, to be passed to cymric_critical_exit().
+// Calls which can block (such as cymric_delay() and waits with a non-zero timeout) must not be made inside one: 
+// they unmask every interrupt, however deeply nested, while the task is switched away, so the section doesn't 
+// protect anything across the call.
+uint32_t cymric_critical_enter(void);
+
+// Leave a critical section, restoring the mask returned by the matching cymric_critical_enter().
+void cymric_critical_exit(uint32_t mask);
 
 // Delay for the time period specified.
 void cymric_delay(uint32_t delay_ms);
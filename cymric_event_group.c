@@ -0,0 +1,112 @@
+#include "cymric_event_group.h"
+#include "cymric.h"
+#include "cymric_internal.h"
+
+#include <stddef.h>
+
+// What a blocked task is waiting for, which its wait_data points to while it waits
+typedef struct {
+	uint32_t mask;
+	uint32_t options;
+	uint32_t bits; // Flags set when the wait was satisfied, filled in by the task that wakes it
+} EventGroupWait;
+
+CymricEventGroup cymric_event_group_init(void) {
+	CymricEventGroup group = {
+		.bits = 0,
+		.waiters = { .head = NULL, .fifo = false },
+	};
+	return group;
+}
+
+// Whether the flags given satisfy a wait.
+static bool prv_satisfied(uint32_t bits, uint32_t mask, uint32_t options) {
+	if(options & CYMRIC_EVENT_GROUP_ALL) {
+		return (bits & mask) == mask;
+	}
+	return (bits & mask) != 0;
+}
+
+// Set flags and wake every task whose wait they satisfy.  Must be called in a critical section.
+static uint32_t prv_set(CymricEventGroup *group, uint32_t bits) {
+	group->bits |= bits;
+
+	// Wake the satisfied waiters in one pass, collecting the flags to clear for after it
+	uint32_t clear = 0;
+	CymricTCB **link = &group->waiters.head;
+	while(*link) {
+		EventGroupWait *wait = (*link)->wait_data;
+		if(prv_satisfied(group->bits, wait->mask, wait->options)) {
+			wait->bits = group->bits;
+			if(wait->options & CYMRIC_EVENT_GROUP_CLEAR) {
+				clear |= wait->mask;
+			}
+			cymric_wake_at(&group->waiters, link); // Moves *link on to the next waiter
+		} else {
+			link = &(*link)->next;
+		}
+	}
+
+	group->bits &= ~clear;
+	return group->bits;
+}
+
+uint32_t cymric_event_group_set(CymricEventGroup *group, uint32_t bits) {
+	uint32_t mask = cymric_critical_enter();
+	uint32_t result = prv_set(group, bits);
+	cymric_critical_exit(mask);
+	return result;
+}
+
+uint32_t cymric_event_group_set_from_isr(CymricEventGroup *group, uint32_t bits) {
+	uint32_t mask = cymric_isr_lock();
+	uint32_t result = prv_set(group, bits);
+	cymric_isr_unlock(mask);
+	return result;
+}
+
+uint32_t cymric_event_group_clear(CymricEventGroup *group, uint32_t bits) {
+	uint32_t mask = cymric_critical_enter();
+	uint32_t prev = group->bits;
+	group->bits &= ~bits;
+	cymric_critical_exit(mask);
+	return prev;
+}
+
+uint32_t cymric_event_group_clear_from_isr(CymricEventGroup *group, uint32_t bits) {
+	uint32_t mask = cymric_isr_lock();
+	uint32_t prev = group->bits;
+	group->bits &= ~bits;
+	cymric_isr_unlock(mask);
+	return prev;
+}
+
+uint32_t cymric_event_group_get(CymricEventGroup *group) {
+	return group->bits;
+}
+
+uint32_t cymric_event_group_wait(CymricEventGroup *group, uint32_t mask, uint32_t options,
+		uint32_t timeout_ms) {
+	if(!mask) return 0;
+
+	uint32_t irq_mask = cymric_critical_enter();
+	if(prv_satisfied(group->bits, mask, options)) {
+		uint32_t bits = group->bits;
+		if(options & CYMRIC_EVENT_GROUP_CLEAR) {
+			group->bits &= ~mask;
+		}
+		cymric_critical_exit(irq_mask);
+		return bits;
+	}
+
+	// Sleep until cymric_event_group_set() finds the wait satisfied, which also clears the flags if asked to
+	EventGroupWait wait = { .mask = mask, .options = options, .bits = 0 };
+	CymricTCB *cur = cymric_cur_tcb();
+	if(cur) {
+		cur->wait_data = &wait;
+	}
+	bool woken = cymric_block(&group->waiters, timeout_ms);
+	cymric_critical_exit(irq_mask);
+
+	return woken ? wait.bits : 0;
+}
@@ -0,0 +1,45 @@
+// Event groups of 32 flags which tasks can wait on combinations of.
+#pragma once
+
+#include <inttypes.h>
+
+#include "cymric.h"
+
+typedef struct {
+	volatile uint32_t bits; // Flags set
+	CymricWaitList waiters; // Tasks blocked waiting for flags to be set
+} CymricEventGroup;
+
+// Options for cymric_event_group_wait(), which can be OR-ed together
+enum {
+	CYMRIC_EVENT_GROUP_ANY = 0, // Wait for any of the flags in the mask to be set
+	CYMRIC_EVENT_GROUP_ALL = 1 << 0, // Wait for all of the flags in the mask to be set
+	CYMRIC_EVENT_GROUP_CLEAR = 1 << 1, // Clear the flags in the mask once the wait is satisfied
+};
+
+// Initialize an event group with no flags set.
+CymricEventGroup cymric_event_group_init(void);
+
+// Set the flags given, waking every waiting task whose wait is now satisfied.  Flags those tasks asked to be
+// cleared are only cleared once all of them have been woken, so they all see the same flags.  Returns the
+// flags left set.
+uint32_t cymric_event_group_set(CymricEventGroup *group, uint32_t bits);
+
+// Version of cymric_event_group_set() that can be called from interrupt handlers.
+uint32_t cymric_event_group_set_from_isr(CymricEventGroup *group, uint32_t bits);
+
+// Clear the flags given.  Returns the flags that were set before clearing them.
+uint32_t cymric_event_group_clear(CymricEventGroup *group, uint32_t bits);
+
+// Version of cymric_event_group_clear() that can be called from interrupt handlers.
+uint32_t cymric_event_group_clear_from_isr(CymricEventGroup *group, uint32_t bits);
+
+// Get the flags currently set.
+uint32_t cymric_event_group_get(CymricEventGroup *group);
+
+// Wait until any (or, with CYMRIC_EVENT_GROUP_ALL, all) of the flags in mask are set, clearing them afterwards
+// if CYMRIC_EVENT_GROUP_CLEAR is given.  If they aren't already set, the calling task sleeps until either they
+// are or the timeout fires.  Call with CYMRIC_TIMEOUT_FOREVER to wait indefinitely.
+// Returns the flags that were set when the wait was satisfied, before any were cleared, or 0 on timeout.
+uint32_t cymric_event_group_wait(CymricEventGroup *group, uint32_t mask, uint32_t options,
+		uint32_t timeout_ms);
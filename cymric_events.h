@@ -0,0 +1,87 @@
+// Hooks for recording kernel events with an external tracing tool, selected by CYMRIC_EVENTS in cymric.h.
+// Each hook expands to nothing when CYMRIC_EVENTS is CYMRIC_EVENTS_NONE.
+//
+// Applications can call CYMRIC_ISR_ENTER() and CYMRIC_ISR_EXIT() at the start and end of their interrupt
+// handlers to show them alongside the kernel's events.
+#pragma once
+
+#include "cymric.h"
+
+#if CYMRIC_EVENTS == CYMRIC_EVENTS_EVENT_RECORDER
+// Keil Event Recorder (the Compiler:Event Recorder software component).  The events are described in
+// EventRecorderStub.scvd, which must be kept in sync with the message numbers below.
+#include "EventRecorder.h"
+#include "stm32f4xx.h"
+
+#define CYMRIC_EVR(level, msg) EventID(level, CYMRIC_EVENTS_COMPONENT, msg)
+
+#define CYMRIC_EVENT_TASK_CREATE(tcb) EventRecord2(CYMRIC_EVR(EventLevelOp, 0x00), (tcb)->id, (tcb)->pri)
+#define CYMRIC_EVENT_TASK_SWITCH(from, to) EventRecord2(CYMRIC_EVR(EventLevelOp, 0x01), (from)->id, (to)->id)
+#define CYMRIC_EVENT_TASK_BLOCK(tcb, timeout_ms) EventRecord2(CYMRIC_EVR(EventLevelOp, 0x02), (tcb)->id, timeout_ms)
+#define CYMRIC_EVENT_TASK_DELAY(tcb, delay_ms) EventRecord2(CYMRIC_EVR(EventLevelOp, 0x03), (tcb)->id, delay_ms)
+#define CYMRIC_EVENT_TASK_UNBLOCK(tcb, expired) EventRecord2(CYMRIC_EVR(EventLevelOp, 0x04), (tcb)->id, expired)
+#define CYMRIC_EVENT_TASK_DELETE(tcb) EventRecord2(CYMRIC_EVR(EventLevelOp, 0x05), (tcb)->id, 0)
+#define CYMRIC_EVENT_TASK_PRIORITY(tcb, new_pri) EventRecord2(CYMRIC_EVR(EventLevelOp, 0x06), (tcb)->id, new_pri)
+
+#define CYMRIC_EVENT_MUTEX_TAKE(mut, timeout_ms) EventRecord2(CYMRIC_EVR(EventLevelAPI, 0x10), (uint32_t)(mut), timeout_ms)
+#define CYMRIC_EVENT_MUTEX_TAKEN(mut) EventRecord2(CYMRIC_EVR(EventLevelOp, 0x11), (uint32_t)(mut), 0)
+#define CYMRIC_EVENT_MUTEX_TIMEOUT(mut) EventRecord2(CYMRIC_EVR(EventLevelError, 0x12), (uint32_t)(mut), 0)
+#define CYMRIC_EVENT_MUTEX_RELEASE(mut, handed_over) EventRecord2(CYMRIC_EVR(EventLevelAPI, 0x13), (uint32_t)(mut), handed_over)
+
+#define CYMRIC_EVENT_SEM_WAIT(sem, timeout_ms) EventRecord2(CYMRIC_EVR(EventLevelAPI, 0x20), (uint32_t)(sem), timeout_ms)
+#define CYMRIC_EVENT_SEM_ACQUIRED(sem) EventRecord2(CYMRIC_EVR(EventLevelOp, 0x21), (uint32_t)(sem), (sem)->count)
+#define CYMRIC_EVENT_SEM_TIMEOUT(sem) EventRecord2(CYMRIC_EVR(EventLevelError, 0x22), (uint32_t)(sem), 0)
+#define CYMRIC_EVENT_SEM_SIGNAL(sem) EventRecord2(CYMRIC_EVR(EventLevelAPI, 0x23), (uint32_t)(sem), (sem)->count)
+
+#define CYMRIC_ISR_ENTER() EventRecord2(CYMRIC_EVR(EventLevelDetail, 0x30), __get_IPSR(), 0)
+#define CYMRIC_ISR_EXIT() EventRecord2(CYMRIC_EVR(EventLevelDetail, 0x31), __get_IPSR(), 0)
+
+#elif CYMRIC_EVENTS == CYMRIC_EVENTS_SYSTEMVIEW
+// SEGGER SystemView, which identifies tasks by their TCB addresses.  It only has events for the task states
+// and interrupts, so mutex and semaphore operations are shown through the tasks blocking and unblocking.
+#include "SEGGER_SYSVIEW.h"
+
+#define CYMRIC_EVENT_TASK_CREATE(tcb) SEGGER_SYSVIEW_OnTaskCreate((U32)(tcb))
+#define CYMRIC_EVENT_TASK_SWITCH(from, to) \
+	((to)->id == CYMRIC_IDLE_ID ? SEGGER_SYSVIEW_OnIdle() : SEGGER_SYSVIEW_OnTaskStartExec((U32)(to)))
+#define CYMRIC_EVENT_TASK_BLOCK(tcb, timeout_ms) SEGGER_SYSVIEW_OnTaskStopReady((U32)(tcb), 0)
+#define CYMRIC_EVENT_TASK_DELAY(tcb, delay_ms) SEGGER_SYSVIEW_OnTaskStopReady((U32)(tcb), 0)
+#define CYMRIC_EVENT_TASK_UNBLOCK(tcb, expired) SEGGER_SYSVIEW_OnTaskStartReady((U32)(tcb))
+#define CYMRIC_EVENT_TASK_DELETE(tcb) SEGGER_SYSVIEW_OnTaskTerminate((U32)(tcb))
+#define CYMRIC_EVENT_TASK_PRIORITY(tcb, new_pri)
+
+#define CYMRIC_EVENT_MUTEX_TAKE(mut, timeout_ms)
+#define CYMRIC_EVENT_MUTEX_TAKEN(mut)
+#define CYMRIC_EVENT_MUTEX_TIMEOUT(mut)
+#define CYMRIC_EVENT_MUTEX_RELEASE(mut, handed_over)
+
+#define CYMRIC_EVENT_SEM_WAIT(sem, timeout_ms)
+#define CYMRIC_EVENT_SEM_ACQUIRED(sem)
+#define CYMRIC_EVENT_SEM_TIMEOUT(sem)
+#define CYMRIC_EVENT_SEM_SIGNAL(sem)
+
+#define CYMRIC_ISR_ENTER() SEGGER_SYSVIEW_RecordEnterISR()
+#define CYMRIC_ISR_EXIT() SEGGER_SYSVIEW_RecordExitISR()
+
+#else
+#define CYMRIC_EVENT_TASK_CREATE(tcb)
+#define CYMRIC_EVENT_TASK_SWITCH(from, to)
+#define CYMRIC_EVENT_TASK_BLOCK(tcb, timeout_ms)
+#define CYMRIC_EVENT_TASK_DELAY(tcb, delay_ms)
+#define CYMRIC_EVENT_TASK_UNBLOCK(tcb, expired)
+#define CYMRIC_EVENT_TASK_DELETE(tcb)
+#define CYMRIC_EVENT_TASK_PRIORITY(tcb, new_pri)
+
+#define CYMRIC_EVENT_MUTEX_TAKE(mut, timeout_ms)
+#define CYMRIC_EVENT_MUTEX_TAKEN(mut)
+#define CYMRIC_EVENT_MUTEX_TIMEOUT(mut)
+#define CYMRIC_EVENT_MUTEX_RELEASE(mut, handed_over)
+
+#define CYMRIC_EVENT_SEM_WAIT(sem, timeout_ms)
+#define CYMRIC_EVENT_SEM_ACQUIRED(sem)
+#define CYMRIC_EVENT_SEM_TIMEOUT(sem)
+#define CYMRIC_EVENT_SEM_SIGNAL(sem)
+
+#define CYMRIC_ISR_ENTER()
+#define CYMRIC_ISR_EXIT()
+#endif
@@ -0,0 +1,279 @@
+#include "cymric_heap.h"
+#include "cymric.h"
+
+#include <stddef.h>
+
+#include "cmsis_armcc.h"
+
+#if CYMRIC_HEAP
+
+// Free blocks are kept in segregated lists indexed at two levels: the first level splits sizes into powers of 2,
+// and the second splits each power of 2 into HEAP_SL_COUNT equal ranges.  Bitmaps of which lists are non-empty
+// let a list whose blocks are all large enough be found with a few CLZ instructions, whatever the heap's state.
+#define HEAP_ALIGN 8
+#define HEAP_SL_BITS 4
+#define HEAP_SL_COUNT (1 << HEAP_SL_BITS)
+#define HEAP_FL_SHIFT (HEAP_SL_BITS + 3) // 3 = log2(HEAP_ALIGN)
+#define HEAP_FL_MAX 20 // log2 of the limit on block sizes
+#define HEAP_FL_COUNT (HEAP_FL_MAX - HEAP_FL_SHIFT + 1)
+#define HEAP_SMALL_SIZE (1ul << HEAP_FL_SHIFT) // Blocks smaller than this all share the first first-level index
+#define HEAP_MAX_SIZE (1ul << HEAP_FL_MAX)
+
+typedef struct HeapBlock {
+	struct HeapBlock *prev_phys; // Block immediately before this one in memory (NULL for the first)
+	uint32_t size; // Size of the block's data, with HEAP_BLOCK_FREE set if it is free
+
+	// Free list linkage, only present in free blocks (in place of their data)
+	struct HeapBlock *next_free;
+	struct HeapBlock *prev_free;
+} HeapBlock;
+
+#define HEAP_BLOCK_FREE 1ul
+#define HEAP_HEADER_SIZE offsetof(HeapBlock, next_free)
+#define HEAP_MIN_SIZE (sizeof(HeapBlock) - HEAP_HEADER_SIZE) // Room for the free list linkage
+
+// Bitmaps of the non-empty free lists
+static uint32_t s_fl_bitmap;
+static uint16_t s_sl_bitmap[HEAP_FL_COUNT];
+
+static HeapBlock *s_free_lists[HEAP_FL_COUNT][HEAP_SL_COUNT];
+
+// Statistics
+static uint32_t s_free;
+static uint32_t s_min_free;
+static uint32_t s_free_blocks;
+static uint32_t s_failures;
+
+// Get the index of the most significant bit set in a non-zero value.
+static inline uint8_t prv_fls(uint32_t x) {
+	return 31 - __clz(x);
+}
+
+// Get the index of the least significant bit set in a non-zero value.
+static inline uint8_t prv_ffs(uint32_t x) {
+	return 31 - __clz(x & -x);
+}
+
+static inline uint32_t prv_block_size(HeapBlock *block) {
+	return block->size & ~HEAP_BLOCK_FREE;
+}
+
+static inline HeapBlock *prv_next_phys(HeapBlock *block) {
+	return (HeapBlock*)((uint8_t*)block + HEAP_HEADER_SIZE + prv_block_size(block));
+}
+
+// Get the indices of the free list holding blocks of the size given.
+static void prv_mapping(uint32_t size, uint8_t *fl, uint8_t *sl) {
+	if(size < HEAP_SMALL_SIZE) {
+		*fl = 0;
+		*sl = size / (HEAP_SMALL_SIZE / HEAP_SL_COUNT);
+	} else {
+		uint8_t bit = prv_fls(size);
+		*sl = (size >> (bit - HEAP_SL_BITS)) ^ HEAP_SL_COUNT;
+		*fl = bit - HEAP_FL_SHIFT + 1;
+	}
+}
+
+// Get the smallest block size held in the free list with the indices given.
+static uint32_t prv_list_min_size(uint8_t fl, uint8_t sl) {
+	if(fl == 0) {
+		return sl * (HEAP_SMALL_SIZE / HEAP_SL_COUNT);
+	}
+	uint8_t bit = fl + HEAP_FL_SHIFT - 1;
+	return (1ul << bit) + ((uint32_t)sl << (bit - HEAP_SL_BITS));
+}
+
+// Add a block to the free list for its size.  Must be called in a critical section.
+static void prv_free_insert(HeapBlock *block) {
+	uint8_t fl, sl;
+	prv_mapping(block->size, &fl, &sl);
+
+	HeapBlock *head = s_free_lists[fl][sl];
+	block->next_free = head;
+	block->prev_free = NULL;
+	if(head) {
+		head->prev_free = block;
+	}
+	s_free_lists[fl][sl] = block;
+	s_fl_bitmap |= 1ul << fl;
+	s_sl_bitmap[fl] |= 1u << sl;
+
+	s_free += block->size;
+	s_free_blocks++;
+	block->size |= HEAP_BLOCK_FREE;
+}
+
+// Remove a block from its free list.  Must be called in a critical section.
+static void prv_free_remove(HeapBlock *block) {
+	block->size &= ~HEAP_BLOCK_FREE;
+	s_free -= block->size;
+	s_free_blocks--;
+
+	uint8_t fl, sl;
+	prv_mapping(block->size, &fl, &sl);
+	if(block->next_free) {
+		block->next_free->prev_free = block->prev_free;
+	}
+	if(block->prev_free) {
+		block->prev_free->next_free = block->next_free;
+	} else {
+		s_free_lists[fl][sl] = block->next_free;
+		if(!block->next_free) {
+			s_sl_bitmap[fl] &= ~(1u << sl);
+			if(!s_sl_bitmap[fl]) {
+				s_fl_bitmap &= ~(1ul << fl);
+			}
+		}
+	}
+}
+
+// Find a free block of at least the size given, or NULL if there are none.  Must be called in a critical section.
+static HeapBlock *prv_free_find(uint32_t size) {
+	// Round the size up to the next list boundary, so that every block in the list found is large enough
+	if(size >= HEAP_SMALL_SIZE) {
+		size += (1ul << (prv_fls(size) - HEAP_SL_BITS)) - 1;
+	}
+
+	uint8_t fl, sl;
+	prv_mapping(size, &fl, &sl);
+	if(fl >= HEAP_FL_COUNT) {
+		return NULL;
+	}
+
+	// Look for a list at the same first level first, then for any list at a higher one
+	uint32_t sl_map = s_sl_bitmap[fl] & (~0ul << sl);
+	if(!sl_map) {
+		uint32_t fl_map = s_fl_bitmap & (~0ul << (fl + 1));
+		if(!fl_map) {
+			return NULL;
+		}
+		fl = prv_ffs(fl_map);
+		sl_map = s_sl_bitmap[fl];
+	}
+	return s_free_lists[fl][prv_ffs(sl_map)];
+}
+
+bool cymric_heap_init(void *region, uint32_t size) {
+	uint32_t start = ((uint32_t)region + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1ul);
+	uint32_t end = ((uint32_t)region + size) & ~(HEAP_ALIGN - 1ul);
+
+	// Room for one block and the zero-sized block marking the end of the region
+	if(end <= start || end - start < sizeof(HeapBlock) + HEAP_HEADER_SIZE) return false;
+	uint32_t data_size = end - start - 2 * HEAP_HEADER_SIZE;
+	if(data_size >= HEAP_MAX_SIZE) return false;
+
+	uint32_t mask = cymric_critical_enter();
+	s_fl_bitmap = 0;
+	for(uint8_t fl = 0; fl < HEAP_FL_COUNT; fl++) {
+		s_sl_bitmap[fl] = 0;
+		for(uint8_t sl = 0; sl < HEAP_SL_COUNT; sl++) {
+			s_free_lists[fl][sl] = NULL;
+		}
+	}
+	s_free = 0;
+	s_free_blocks = 0;
+	s_failures = 0;
+
+	HeapBlock *block = (HeapBlock*)start;
+	block->prev_phys = NULL;
+	block->size = data_size;
+
+	// The end marker is never free, so blocks are never merged past it
+	HeapBlock *end_block = prv_next_phys(block);
+	end_block->prev_phys = block;
+	end_block->size = 0;
+
+	prv_free_insert(block);
+	s_min_free = s_free;
+	cymric_critical_exit(mask);
+
+	return true;
+}
+
+void *cymric_heap_alloc(uint32_t size) {
+	if(!size) return NULL;
+
+	uint32_t mask = cymric_critical_enter();
+	HeapBlock *block = NULL;
+	if(size < HEAP_MAX_SIZE) {
+		size = (size < HEAP_MIN_SIZE) ? HEAP_MIN_SIZE : (size + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1ul);
+		block = prv_free_find(size);
+	}
+	if(!block) {
+		s_failures++;
+		cymric_critical_exit(mask);
+		return NULL;
+	}
+
+	prv_free_remove(block);
+
+	// Split off the rest of the block if it is large enough to be a block of its own
+	if(block->size >= size + sizeof(HeapBlock)) {
+		HeapBlock *rest = (HeapBlock*)((uint8_t*)block + HEAP_HEADER_SIZE + size);
+		rest->prev_phys = block;
+		rest->size = block->size - size - HEAP_HEADER_SIZE;
+		prv_next_phys(rest)->prev_phys = rest;
+		block->size = size;
+		prv_free_insert(rest);
+	}
+
+	if(s_free < s_min_free) {
+		s_min_free = s_free;
+	}
+	cymric_critical_exit(mask);
+
+	return (uint8_t*)block + HEAP_HEADER_SIZE;
+}
+
+void cymric_heap_free(void *ptr) {
+	if(!ptr) return;
+
+	HeapBlock *block = (HeapBlock*)((uint8_t*)ptr - HEAP_HEADER_SIZE);
+	uint32_t mask = cymric_critical_enter();
+
+	// Merge with the free blocks on either side
+	HeapBlock *prev = block->prev_phys;
+	if(prev && (prev->size & HEAP_BLOCK_FREE)) {
+		prv_free_remove(prev);
+		prev->size += HEAP_HEADER_SIZE + block->size;
+		block = prev;
+	}
+	HeapBlock *next = prv_next_phys(block);
+	if(next->size & HEAP_BLOCK_FREE) {
+		prv_free_remove(next);
+		block->size += HEAP_HEADER_SIZE + next->size;
+	}
+	prv_next_phys(block)->prev_phys = block;
+
+	prv_free_insert(block);
+	cymric_critical_exit(mask);
+}
+
+void cymric_heap_stats(CymricHeapStats *stats) {
+	uint32_t mask = cymric_critical_enter();
+	stats->free = s_free;
+	stats->min_free = s_min_free;
+	stats->free_blocks = s_free_blocks;
+	stats->failures = s_failures;
+
+	// The largest free block is in the highest non-empty list.  Requests are rounded up to the next list's sizes
+	// before searching, so only up to the smallest size of that list is sure to be found.
+	uint32_t largest = 0;
+	uint32_t max_alloc = 0;
+	if(s_fl_bitmap) {
+		uint8_t fl = prv_fls(s_fl_bitmap);
+		uint8_t sl = prv_fls(s_sl_bitmap[fl]);
+		for(HeapBlock *block = s_free_lists[fl][sl]; block; block = block->next_free) {
+			if(prv_block_size(block) > largest) {
+				largest = prv_block_size(block);
+			}
+		}
+		max_alloc = prv_list_min_size(fl, sl);
+	}
+	stats->largest_free = largest;
+	stats->max_alloc = max_alloc;
+	stats->fragmentation = s_free ? 100 - largest * 100 / s_free : 0;
+	cymric_critical_exit(mask);
+}
+
+#endif
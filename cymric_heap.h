@@ -0,0 +1,35 @@
+// Real-time heap over a region supplied by the application (enabled with CYMRIC_HEAP).  Allocation and freeing
+// take constant time, using a two-level segregated fit (TLSF) allocator.
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "cymric.h"
+
+// Heap usage statistics.  Sizes are in bytes, excluding the allocator's headers.
+typedef struct {
+	uint32_t free; // Bytes free
+	uint32_t min_free; // Lowest number of bytes free since the heap was initialized
+	uint32_t largest_free; // Size of the largest free block
+	// Largest allocation sure to succeed.  This can be less than largest_free, since requests are rounded up to 
+	// the next size class (up to 1/16 larger) so that a block can be found in constant time.
+	uint32_t max_alloc;
+	uint32_t free_blocks; // Number of free blocks
+	uint8_t fragmentation; // Percentage of the free bytes outside the largest free block
+	uint32_t failures; // Number of allocations which failed
+} CymricHeapStats;
+
+// Initialize the heap over the region given, of size bytes (up to 1MB).  Any blocks allocated from a previous
+// region are forgotten.  Returns false if the region is too small or too large, true otherwise.
+bool cymric_heap_init(void *region, uint32_t size);
+
+// Allocate size bytes, 8-byte aligned.  Returns NULL if size is 0 or there is no free block large enough.
+void *cymric_heap_alloc(uint32_t size);
+
+// Free a block allocated by cymric_heap_alloc(), merging it with any free blocks on either side.  Does nothing
+// if ptr is NULL.
+void cymric_heap_free(void *ptr);
+
+// Get the usage statistics of the heap.
+void cymric_heap_stats(CymricHeapStats *stats);
@@ -0,0 +1,54 @@
+// Kernel interface for use by the cymric synchronization primitives.  Not intended for use by applications.
+#pragma once
+
+#include "cymric.h"
+
+// Enter a critical section on behalf of an interrupt handler.  Until cymric_isr_unlock() is called, context 
+// switches requested by the kernel are left for PendSV_Handler to decide on.  Returns the previous interrupt 
+// mask to pass to cymric_isr_unlock().
+uint32_t cymric_isr_lock(void);
+
+// Leave a critical section entered by cymric_isr_lock().
+void cymric_isr_unlock(uint32_t mask);
+
+#if CYMRIC_TIMERS
+// Create the timer task.  Returns true if successful, false otherwise.
+bool cymric_timer_service_init(void);
+
+// Advance the software timers by a tick, queuing the callbacks of any which expire for the timer task.
+// Called by SysTick_Handler().
+void cymric_timer_tick(void);
+
+// Get the number of ticks until the next tick on which cymric_timer_tick() has work to do, or 
+// CYMRIC_TIMEOUT_FOREVER if no timers are running.  Must be called in a critical section.
+uint32_t cymric_timer_idle_ticks(void);
+
+// Advance the software timers by ticks which passed while the tick was stopped, all of which must come before 
+// the tick given by cymric_timer_idle_ticks().  Must be called in a critical section.
+void cymric_timer_skip(uint32_t ticks);
+#endif
+
+// Get the TCB of the running task.  Returns NULL if the RTOS has not been started.
+struct CymricTCB *cymric_cur_tcb(void);
+
+// Block the running task on the wait list given until it is woken by cymric_wake() or the timeout expires.
+// Must be called in a critical section, which is briefly left completely (even if nested) to allow the context
+// switch, and is re-entered on return.  Returns true if the task was woken, false if it timed out (or could not block).
+bool cymric_block(CymricWaitList *list, uint32_t timeout_ms);
+
+// Wake the highest-priority task blocked on the wait list given, requesting a context switch if it should 
+// pre-empt the running task.  Must be called in a critical section.  Returns the TCB of the task woken,
+// or NULL if no task was waiting.
+struct CymricTCB *cymric_wake(CymricWaitList *list);
+
+// Wake the task blocked on the wait list given which *link points to (either the list's head or the next field 
+// of a task before it in the list), leaving *link pointing to the task after it.  This lets waiters be picked out
+// in one pass through the list.  Must be called in a critical section.  Returns the TCB of the task woken.
+struct CymricTCB *cymric_wake_at(CymricWaitList *list, struct CymricTCB **link);
+
+// Transfer ownership of the object whose wait list is given to the task given (or to no task if NULL).
+// The previous owner's priority is restored and the new owner is raised to the list's ceiling and inherits 
+// the priority of the remaining waiters.
+// While owned, tasks blocking on the list raise the owner's priority to their own, transitively through any
+// object the owner is itself blocked on.  Must be called in a critical section.
+void cymric_set_owner(CymricWaitList *list, struct CymricTCB *owner);
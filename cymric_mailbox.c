@@ -0,0 +1,22 @@
+#include "cymric_mailbox.h"
+#include "cymric_queue.h"
+
+CymricMailbox cymric_mbox_init(void **slots, uint32_t capacity) {
+	CymricMailbox mbox = {
+		.queue = cymric_queue_init(slots, sizeof(void*), capacity),
+	};
+	return mbox;
+}
+
+CymricQueueStatus cymric_mbox_post(CymricMailbox *mbox, void *msg, uint32_t timeout_ms) {
+	// Only the pointer itself is copied
+	return cymric_queue_send(&mbox->queue, &msg, timeout_ms);
+}
+
+CymricQueueStatus cymric_mbox_post_from_isr(CymricMailbox *mbox, void *msg) {
+	return cymric_queue_send_from_isr(&mbox->queue, &msg);
+}
+
+CymricQueueStatus cymric_mbox_fetch(CymricMailbox *mbox, void **msg, uint32_t timeout_ms) {
+	return cymric_queue_receive(&mbox->queue, msg, timeout_ms);
+}
@@ -0,0 +1,31 @@
+// Mailboxes passing pointers between tasks, so that buffers can be handed over without copying their contents.
+#pragma once
+
+#include <inttypes.h>
+
+#include "cymric.h"
+#include "cymric_queue.h"
+
+// A mailbox is a queue of pointers.  Posting a pointer hands ownership of the buffer it points to over to
+// the task which fetches it, which is responsible for freeing or reusing it.
+typedef struct {
+	CymricQueue queue;
+} CymricMailbox;
+
+// Initialize a mailbox holding up to capacity pointers, stored in slots (which must have at least capacity
+// entries).  Waiting tasks are woken highest priority first.
+CymricMailbox cymric_mbox_init(void **slots, uint32_t capacity);
+
+// Post a message to the mailbox, or directly to a waiting task if there is one.
+// If the mailbox is full, the calling task sleeps until either there is space or the timeout fires.
+// Call with CYMRIC_TIMEOUT_FOREVER to wait indefinitely.
+CymricQueueStatus cymric_mbox_post(CymricMailbox *mbox, void *msg, uint32_t timeout_ms);
+
+// Version of cymric_mbox_post() that can be called from interrupt handlers.  Returns CYMRIC_QUEUE_STATUS_FULL
+// instead of waiting if the mailbox is full.
+CymricQueueStatus cymric_mbox_post_from_isr(CymricMailbox *mbox, void *msg);
+
+// Fetch the oldest message from the mailbox into msg.
+// If the mailbox is empty, the calling task sleeps until either a message is posted or the timeout fires.
+// Call with CYMRIC_TIMEOUT_FOREVER to wait indefinitely.
+CymricQueueStatus cymric_mbox_fetch(CymricMailbox *mbox, void **msg, uint32_t timeout_ms);
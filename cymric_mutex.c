@@ -1,42 +1,79 @@
 #include "cymric_mutex.h"
+
+#include <stddef.h>
+
 #include "cymric.h"
+#include "cymric_internal.h"
+#include "cymric_events.h"
 
 CymricMutex cymric_mut_init(CymricMutState initial_state) {
     CymricMutex mut = {
         .state = initial_state,
-        .id = 0, // Unused currently
+        .waiters = { .head = NULL, .owner = NULL, .next_owned = NULL, .ceiling = CYMRIC_PRI_IDLE },
     };
     return mut;
 }
 
-void cymric_mut_release(CymricMutex *mut) {
-    // Don't need to worry about conflicting accesses since writes <= word size
-    // should be atomic on ARM
-    mut->state = CYMRIC_MUT_STATE_RELEASED;
+CymricMutex cymric_mut_init_ceiling(CymricPriority ceiling_pri) {
+    CymricMutex mut = cymric_mut_init(CYMRIC_MUT_STATE_RELEASED);
+
+#if NUM_CYMRIC_PRIORITIES < 256
+    // Clamp to the highest priority, since the owner is made ready at its ceiling
+    if(ceiling_pri >= NUM_CYMRIC_PRIORITIES) {
+        ceiling_pri = NUM_CYMRIC_PRIORITIES - 1;
+    }
+#endif
+
+    // The kernel raises the owner of the wait list to its ceiling
+    mut.waiters.ceiling = ceiling_pri;
+    return mut;
 }
 
-CymricMutStatus cymric_mut_take(CymricMutex *mut, uint32_t timeout_ms) {
-    // This can overflow if timeout_ms == CYMRIC_TIMEOUT_FOREVER,
-    // but we don't use the timeout anyways in that case
-    uint32_t timeout_end_ms = cymric_get_ticks() + timeout_ms;
-
-    bool finished = false;
-    while(!finished) {
-        // Check for timeout
-        if(timeout_ms != CYMRIC_TIMEOUT_FOREVER) {
-            if(timeout_end_ms < cymric_get_ticks()) {
-                return CYMRIC_MUT_STATUS_TIMEOUT;
-            }
-        }
-
-        // Check mutex state and take it if released
-        __disable_irq();
-        if(mut->state == CYMRIC_MUT_STATE_RELEASED) {
-            finished = true;
-            mut->state = CYMRIC_MUT_STATE_TAKEN;
-        }
-        __enable_irq();
+CymricMutStatus cymric_mut_release(CymricMutex *mut) {
+    uint32_t mask = cymric_critical_enter();
+
+    // Releasing on behalf of the owner would drop the priority it inherited while it still holds the mutex
+    if(mut->waiters.owner && mut->waiters.owner != cymric_cur_tcb()) {
+        cymric_critical_exit(mask);
+        return CYMRIC_MUT_STATUS_NOT_OWNER;
+    }
+
+    // Hand the mutex straight to the highest-priority waiter so that no other task can take it first
+    struct CymricTCB *next = cymric_wake(&mut->waiters);
+    if(!next) {
+        mut->state = CYMRIC_MUT_STATE_RELEASED;
     }
 
+    // Restores the caller's priority and lets the new owner inherit from the remaining waiters
+    cymric_set_owner(&mut->waiters, next);
+    CYMRIC_EVENT_MUTEX_RELEASE(mut, next != NULL);
+
+    cymric_critical_exit(mask);
     return CYMRIC_MUT_STATUS_OK;
 }
+
+CymricMutStatus cymric_mut_take(CymricMutex *mut, uint32_t timeout_ms) {
+    uint32_t mask = cymric_critical_enter();
+    CYMRIC_EVENT_MUTEX_TAKE(mut, timeout_ms);
+
+    // Take the mutex immediately if it is free (raising the caller to the ceiling for ceiling mutexes)
+    if(mut->state == CYMRIC_MUT_STATE_RELEASED) {
+        mut->state = CYMRIC_MUT_STATE_TAKEN;
+        cymric_set_owner(&mut->waiters, cymric_cur_tcb());
+        CYMRIC_EVENT_MUTEX_TAKEN(mut);
+        cymric_critical_exit(mask);
+        return CYMRIC_MUT_STATUS_OK;
+    }
+
+    // Otherwise sleep until cymric_mut_release() hands it over, boosting the owner's priority while waiting
+    bool taken = cymric_block(&mut->waiters, timeout_ms);
+    if(taken) {
+        CYMRIC_EVENT_MUTEX_TAKEN(mut);
+    } else {
+        CYMRIC_EVENT_MUTEX_TIMEOUT(mut);
+    }
+
+    cymric_critical_exit(mask);
+
+    return taken ? CYMRIC_MUT_STATUS_OK : CYMRIC_MUT_STATUS_TIMEOUT;
+}
@@ -2,6 +2,8 @@
 
 #include <inttypes.h>
 
+#include "cymric.h"
+
 // States
 typedef enum {
     CYMRIC_MUT_STATE_RELEASED = 0,
@@ -11,22 +13,36 @@ typedef enum {
 
 typedef struct {
     volatile CymricMutState state;
-    uint8_t id;
+
+    // Tasks blocked waiting to take the mutex.  Its owner is the task holding the mutex (NULL if released 
+    // or taken before the RTOS started), which inherits the priority of the highest-priority waiter.
+    CymricWaitList waiters;
 } CymricMutex;
 
 // Status codes
 typedef enum {
     CYMRIC_MUT_STATUS_OK = 0,
     CYMRIC_MUT_STATUS_TIMEOUT,
+    CYMRIC_MUT_STATUS_NOT_OWNER, // The mutex is held by another task
     NUM_CYMRIC_MUT_STATUSES,
 } CymricMutStatus;
 
 // Initialize a mutex with the the initial state given.
 CymricMutex cymric_mut_init(CymricMutState initial_state);
 
-// Release a mutex, allowing it to be taken by future threads.
-void cymric_mut_release(CymricMutex *mut);
+// Initialize a released mutex using the immediate priority ceiling protocol.  A task taking the mutex runs at
+// ceiling_pri (or its own priority if higher) until it releases it.  ceiling_pri should be at least the priority
+// of every task that takes the mutex, in which case it can never be contended by a task that hasn't blocked
+// while holding it.  A ceiling_pri not below NUM_CYMRIC_PRIORITIES is clamped to the highest priority.
+CymricMutex cymric_mut_init_ceiling(CymricPriority ceiling_pri);
+
+// Release a mutex, handing it directly to the highest-priority task waiting on it if there is one.
+// Any priority the caller inherited through the mutex is given up.  Only the task holding the mutex may release 
+// it (any task may if it was taken before the RTOS started); otherwise the mutex is left as it is and
+// CYMRIC_MUT_STATUS_NOT_OWNER is returned.
+CymricMutStatus cymric_mut_release(CymricMutex *mut);
 
-// Attempt to take a mutex.  Will block for the timeout requested and then return.
+// Attempt to take a mutex.  The calling task sleeps until the mutex is handed to it or the timeout 
+// requested expires, lending its priority to the holder in the meantime.
 // Pass in CYMRIC_TIMEOUT_FOREVER to block indefinitely.
 CymricMutStatus cymric_mut_take(CymricMutex *mut, uint32_t timeout_ms);
@@ -0,0 +1,103 @@
+#include "cymric_pool.h"
+#include "cymric.h"
+#include "cymric_internal.h"
+
+#include <stddef.h>
+
+CymricPool cymric_pool_init(void *buf, uint32_t block_size, uint32_t num_blocks) {
+	CymricPool pool = {
+		.free = NULL,
+		.block_size = CYMRIC_POOL_BLOCK_SIZE(block_size),
+		.num_blocks = num_blocks,
+		.in_use = 0,
+		.peak = 0,
+		.failures = 0,
+		.waiters = { .head = NULL, .fifo = false },
+	};
+
+	// Link the blocks into the free list, lowest address first
+	uint8_t *block = (uint8_t*)buf + pool.block_size * num_blocks;
+	for(uint32_t i = 0; i < num_blocks; i++) {
+		block -= pool.block_size;
+		*(void**)block = pool.free;
+		pool.free = block;
+	}
+	return pool;
+}
+
+// Take a block from the free list, returning NULL if it is empty.  Must be called in a critical section.
+static void *prv_alloc(CymricPool *pool) {
+	void *block = pool->free;
+	if(block) {
+		pool->free = *(void**)block;
+		pool->in_use++;
+		if(pool->in_use > pool->peak) {
+			pool->peak = pool->in_use;
+		}
+	}
+	return block;
+}
+
+// Hand a block to the highest-priority waiting task, or put it back on the free list if there are none.
+// Must be called in a critical section.
+static void prv_free(CymricPool *pool, void *block) {
+	CymricTCB *waiter = pool->waiters.head;
+	if(waiter) {
+		// Stays allocated, now to the waiter
+		waiter->wait_data = block;
+		cymric_wake(&pool->waiters);
+		return;
+	}
+
+	*(void**)block = pool->free;
+	pool->free = block;
+	pool->in_use--;
+}
+
+void *cymric_pool_alloc(CymricPool *pool, uint32_t timeout_ms) {
+	uint32_t mask = cymric_critical_enter();
+	void *block = prv_alloc(pool);
+	if(!block) {
+		// Sleep until cymric_pool_free() hands a block over directly
+		CymricTCB *cur = cymric_cur_tcb();
+		if(cymric_block(&pool->waiters, timeout_ms)) {
+			block = cur->wait_data;
+		} else {
+			pool->failures++;
+		}
+	}
+	cymric_critical_exit(mask);
+
+	return block;
+}
+
+void *cymric_pool_alloc_from_isr(CymricPool *pool) {
+	uint32_t mask = cymric_isr_lock();
+	void *block = prv_alloc(pool);
+	if(!block) {
+		pool->failures++;
+	}
+	cymric_isr_unlock(mask);
+
+	return block;
+}
+
+void cymric_pool_free(CymricPool *pool, void *block) {
+	uint32_t mask = cymric_critical_enter();
+	prv_free(pool, block);
+	cymric_critical_exit(mask);
+}
+
+void cymric_pool_free_from_isr(CymricPool *pool, void *block) {
+	uint32_t mask = cymric_isr_lock();
+	prv_free(pool, block);
+	cymric_isr_unlock(mask);
+}
+
+void cymric_pool_stats(CymricPool *pool, CymricPoolStats *stats) {
+	uint32_t mask = cymric_critical_enter();
+	stats->in_use = pool->in_use;
+	stats->peak = pool->peak;
+	stats->failures = pool->failures;
+	cymric_critical_exit(mask);
+}
@@ -0,0 +1,51 @@
+// Fixed-block memory pools, allocating equal-sized blocks from a buffer supplied by the application.
+#pragma once
+
+#include <inttypes.h>
+
+#include "cymric.h"
+
+// Size of each block carved from a pool's buffer for blocks of block_size bytes, which is rounded up to keep
+// the blocks word aligned.
+#define CYMRIC_POOL_BLOCK_SIZE(block_size) (((block_size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+// Size of the buffer needed for a pool of num_blocks blocks of block_size bytes.
+#define CYMRIC_POOL_BUF_SIZE(block_size, num_blocks) (CYMRIC_POOL_BLOCK_SIZE(block_size) * (num_blocks))
+
+typedef struct {
+	void *free; // First free block.  Each free block begins with a pointer to the next one.
+	uint32_t block_size;
+	uint32_t num_blocks;
+	uint32_t in_use; // Number of blocks allocated
+	uint32_t peak; // Highest number of blocks allocated at once
+	uint32_t failures; // Number of allocations which failed for lack of a free block
+	CymricWaitList waiters; // Tasks blocked waiting for a block to be freed
+} CymricPool;
+
+// Pool usage statistics.
+typedef struct {
+	uint32_t in_use;
+	uint32_t peak;
+	uint32_t failures;
+} CymricPoolStats;
+
+// Initialize a pool of num_blocks blocks of block_size bytes in buf, which must be word aligned and at least
+// CYMRIC_POOL_BUF_SIZE(block_size, num_blocks) bytes.  Waiting tasks are woken highest priority first.
+CymricPool cymric_pool_init(void *buf, uint32_t block_size, uint32_t num_blocks);
+
+// Allocate a block from the pool.  If none are free, the calling task sleeps until either one is freed or the
+// timeout fires (pass 0 to return immediately, or CYMRIC_TIMEOUT_FOREVER to wait indefinitely).
+// Returns the block, or NULL on timeout.
+void *cymric_pool_alloc(CymricPool *pool, uint32_t timeout_ms);
+
+// Version of cymric_pool_alloc() that can be called from interrupt handlers.  Returns NULL if no block is free.
+void *cymric_pool_alloc_from_isr(CymricPool *pool);
+
+// Return a block to the pool, handing it directly to a waiting task if there is one.
+void cymric_pool_free(CymricPool *pool, void *block);
+
+// Version of cymric_pool_free() that can be called from interrupt handlers.
+void cymric_pool_free_from_isr(CymricPool *pool, void *block);
+
+// Get the usage statistics of a pool.
+void cymric_pool_stats(CymricPool *pool, CymricPoolStats *stats);
@@ -0,0 +1,111 @@
+#include "cymric_queue.h"
+#include "cymric.h"
+#include "cymric_internal.h"
+
+#include <stddef.h>
+#include <string.h>
+
+// Receivers only wait while the queue is empty and senders only while it is full, so an item is always handed
+// straight to a waiting receiver, and a blocked sender's item is moved into the space freed by a receive.
+// Blocked tasks point wait_data at the item they are sending or the buffer they are receiving into.
+
+CymricQueue cymric_queue_init(void *buf, uint32_t item_size, uint32_t capacity) {
+	CymricQueue queue = {
+		.buf = buf,
+		.item_size = item_size,
+		.capacity = capacity,
+		.head = 0,
+		.count = 0,
+		.senders = { .head = NULL, .fifo = false },
+		.receivers = { .head = NULL, .fifo = false },
+	};
+	return queue;
+}
+
+// Get the address of the slot the given number of items from the front of the queue.
+static uint8_t *prv_slot(CymricQueue *queue, uint32_t offset) {
+	uint32_t index = queue->head + offset;
+	if(index >= queue->capacity) {
+		index -= queue->capacity;
+	}
+	return queue->buf + index * queue->item_size;
+}
+
+// Hand an item to the highest-priority waiting receiver, or add it to the back of the queue if there is space.
+// Returns false if the queue is full.  Must be called in a critical section.
+static bool prv_send(CymricQueue *queue, const void *item) {
+	CymricTCB *receiver = queue->receivers.head;
+	if(receiver) {
+		memcpy(receiver->wait_data, item, queue->item_size);
+		cymric_wake(&queue->receivers);
+		return true;
+	}
+
+	if(queue->count == queue->capacity) {
+		return false;
+	}
+
+	memcpy(prv_slot(queue, queue->count), item, queue->item_size);
+	queue->count++;
+	return true;
+}
+
+CymricQueueStatus cymric_queue_send(CymricQueue *queue, const void *item, uint32_t timeout_ms) {
+	uint32_t mask = cymric_critical_enter();
+	if(prv_send(queue, item)) {
+		cymric_critical_exit(mask);
+		return CYMRIC_QUEUE_STATUS_OK;
+	}
+
+	// Sleep until cymric_queue_receive() moves the item into the queue
+	CymricTCB *cur = cymric_cur_tcb();
+	if(cur) {
+		cur->wait_data = (void*)item;
+	}
+	bool sent = cymric_block(&queue->senders, timeout_ms);
+	cymric_critical_exit(mask);
+
+	return sent ? CYMRIC_QUEUE_STATUS_OK : CYMRIC_QUEUE_STATUS_TIMEOUT;
+}
+
+CymricQueueStatus cymric_queue_send_from_isr(CymricQueue *queue, const void *item) {
+	uint32_t mask = cymric_isr_lock();
+	bool sent = prv_send(queue, item);
+	cymric_isr_unlock(mask);
+
+	return sent ? CYMRIC_QUEUE_STATUS_OK : CYMRIC_QUEUE_STATUS_FULL;
+}
+
+CymricQueueStatus cymric_queue_receive(CymricQueue *queue, void *item, uint32_t timeout_ms) {
+	uint32_t mask = cymric_critical_enter();
+	if(queue->count > 0) {
+		memcpy(item, prv_slot(queue, 0), queue->item_size);
+		queue->head = (queue->head + 1 == queue->capacity) ? 0 : queue->head + 1;
+		queue->count--;
+
+		// Let the highest-priority waiting sender fill the space
+		CymricTCB *sender = queue->senders.head;
+		if(sender) {
+			memcpy(prv_slot(queue, queue->count), sender->wait_data, queue->item_size);
+			queue->count++;
+			cymric_wake(&queue->senders);
+		}
+
+		cymric_critical_exit(mask);
+		return CYMRIC_QUEUE_STATUS_OK;
+	}
+
+	// Sleep until cymric_queue_send() copies an item over directly
+	CymricTCB *cur = cymric_cur_tcb();
+	if(cur) {
+		cur->wait_data = item;
+	}
+	bool received = cymric_block(&queue->receivers, timeout_ms);
+	cymric_critical_exit(mask);
+
+	return received ? CYMRIC_QUEUE_STATUS_OK : CYMRIC_QUEUE_STATUS_TIMEOUT;
+}
+
+uint32_t cymric_queue_count(CymricQueue *queue) {
+	return queue->count;
+}
@@ -0,0 +1,45 @@
+// Message queues of fixed-size items, copied into and out of a ring buffer supplied by the application.
+#pragma once
+
+#include <inttypes.h>
+
+#include "cymric.h"
+
+typedef struct {
+	uint8_t *buf; // Storage for capacity items of item_size bytes
+	uint32_t item_size;
+	uint32_t capacity;
+	uint32_t head; // Index of the oldest item
+	volatile uint32_t count; // Number of items in the queue
+	CymricWaitList senders; // Tasks blocked waiting for space to send
+	CymricWaitList receivers; // Tasks blocked waiting for an item to receive
+} CymricQueue;
+
+// Status codes
+typedef enum {
+	CYMRIC_QUEUE_STATUS_OK = 0,
+	CYMRIC_QUEUE_STATUS_TIMEOUT,
+	CYMRIC_QUEUE_STATUS_FULL, // Returned by cymric_queue_send_from_isr(), which can't wait for space
+	NUM_CYMRIC_QUEUE_STATUSES,
+} CymricQueueStatus;
+
+// Initialize a queue of up to capacity items of item_size bytes, stored in buf (which must be at least
+// item_size * capacity bytes, and capacity at least 1).  Waiting tasks are woken highest priority first.
+CymricQueue cymric_queue_init(void *buf, uint32_t item_size, uint32_t capacity);
+
+// Copy an item to the back of the queue, or directly to a waiting receiver if there is one.
+// If the queue is full, the calling task sleeps until either there is space or the timeout fires.
+// Call with CYMRIC_TIMEOUT_FOREVER to wait indefinitely.
+CymricQueueStatus cymric_queue_send(CymricQueue *queue, const void *item, uint32_t timeout_ms);
+
+// Version of cymric_queue_send() that can be called from interrupt handlers.  Returns CYMRIC_QUEUE_STATUS_FULL
+// instead of waiting if the queue is full.
+CymricQueueStatus cymric_queue_send_from_isr(CymricQueue *queue, const void *item);
+
+// Copy the item at the front of the queue into item and remove it.
+// If the queue is empty, the calling task sleeps until either an item is sent or the timeout fires.
+// Call with CYMRIC_TIMEOUT_FOREVER to wait indefinitely.
+CymricQueueStatus cymric_queue_receive(CymricQueue *queue, void *item, uint32_t timeout_ms);
+
+// Get the number of items in the queue.
+uint32_t cymric_queue_count(CymricQueue *queue);
@@ -1,35 +1,64 @@
 #include "cymric_semaphore.h"
 #include "cymric.h"
+#include "cymric_internal.h"
+#include "cymric_events.h"
+
+#include <stddef.h>
 
 CymricSemaphore cymric_sem_init(uint32_t initial_count) {
 	CymricSemaphore sem = {
-        .id = 0, // ID is unused currently
         .count = initial_count,
+        .waiters = { .head = NULL, .fifo = false },
     };
     return sem;
 }
 
+CymricSemaphore cymric_sem_init_fifo(uint32_t initial_count) {
+    CymricSemaphore sem = cymric_sem_init(initial_count);
+    sem.waiters.fifo = true;
+    return sem;
+}
+
+// Hand the signal to a waiting task if there is one, otherwise increase the count.
+// Must be called in a critical section.
+static void prv_signal(CymricSemaphore *sem) {
+    if(!cymric_wake(&sem->waiters)) {
+        sem->count++;
+    }
+    CYMRIC_EVENT_SEM_SIGNAL(sem);
+}
+
 void cymric_sem_signal(CymricSemaphore *sem) {
-    __disable_irq();
-    sem->count++;
-    __enable_irq();
+    uint32_t mask = cymric_critical_enter();
+    prv_signal(sem);
+    cymric_critical_exit(mask);
+}
+
+void cymric_sem_signal_from_isr(CymricSemaphore *sem) {
+    uint32_t mask = cymric_isr_lock();
+    prv_signal(sem);
+    cymric_isr_unlock(mask);
 }
 
 CymricSemStatus cymric_sem_wait(CymricSemaphore *sem, uint32_t timeout_ms) {
-    if(timeout_ms == CYMRIC_TIMEOUT_FOREVER) {
-        while(sem->count == 0) {}
+    uint32_t mask = cymric_critical_enter();
+    CYMRIC_EVENT_SEM_WAIT(sem, timeout_ms);
+    if(sem->count > 0) {
+        sem->count--;
+        CYMRIC_EVENT_SEM_ACQUIRED(sem);
+        cymric_critical_exit(mask);
+        return CYMRIC_SEM_STATUS_OK;
+    }
+
+    // Sleep until cymric_sem_signal() hands a signal over directly
+    bool signalled = cymric_block(&sem->waiters, timeout_ms);
+    if(signalled) {
+        CYMRIC_EVENT_SEM_ACQUIRED(sem);
     } else {
-        uint32_t timeout_end_ms = cymric_get_ticks() + timeout_ms;
-        while(sem->count == 0) {
-            if(cymric_get_ticks() <= timeout_end_ms) {
-                // Timeout reached, return
-                return CYMRIC_SEM_STATUS_TIMEOUT;
-            }
-        }
+        CYMRIC_EVENT_SEM_TIMEOUT(sem);
     }
-    __disable_irq();
-    sem->count--;
-    __enable_irq();
 
-    return CYMRIC_SEM_STATUS_OK;
+    cymric_critical_exit(mask);
+
+    return signalled ? CYMRIC_SEM_STATUS_OK : CYMRIC_SEM_STATUS_TIMEOUT;
 }
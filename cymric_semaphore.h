@@ -3,9 +3,11 @@
 
 #include <inttypes.h>
 
+#include "cymric.h"
+
 typedef struct {
 	volatile uint32_t count;
-	uint8_t id;
+	CymricWaitList waiters; // Tasks blocked waiting for the count to be increased
 } CymricSemaphore;
 
 // Status codes
@@ -15,14 +17,20 @@ typedef enum {
 	NUM_CYMRIC_SEM_STATUSES,
 } CymricSemStatus;
 
-// Initialize a semaphore with the initial count given.
+// Initialize a semaphore with the initial count given.  Waiting tasks are woken highest priority first.
 CymricSemaphore cymric_sem_init(uint32_t initial_count);
 
-// Increase the count of the semaphore.
+// Initialize a semaphore with the initial count given.  Waiting tasks are woken in the order they started waiting.
+CymricSemaphore cymric_sem_init_fifo(uint32_t initial_count);
+
+// Increase the count of the semaphore, or wake exactly one waiting task if there are any.
 void cymric_sem_signal(CymricSemaphore *sem);
 
+// Version of cymric_sem_signal() that can be called from interrupt handlers.
+void cymric_sem_signal_from_isr(CymricSemaphore *sem);
+
 // Attempt to decrease the count of the semaphore if its count is > 0.  
-// Will until either the decrement is successful or the timeout fires.
+// Otherwise, the calling task sleeps until either it is signalled or the timeout fires.
 // Call with CYMRIC_TIMEOUT_FOREVER to wait indefinitely.
 // Returns a status code corresponding to the result of the wait attempt.
 CymricSemStatus cymric_sem_wait(CymricSemaphore *sem, uint32_t timeout_ms);
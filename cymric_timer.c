@@ -0,0 +1,251 @@
+#include "cymric_timer.h"
+#include "cymric.h"
+#include "cymric_internal.h"
+
+#include <stddef.h>
+
+#if CYMRIC_TIMERS
+
+// Timers are kept in a hierarchical timing wheel of WHEEL_LEVELS levels of WHEEL_SLOTS slots.  Level 0 has a slot
+// for each of the next WHEEL_SLOTS ticks, and each slot of a higher level covers a whole turn of the level below it.
+// When the wheel reaches a higher-level slot, its timers are cascaded down into the lower levels.  Timers due
+// further ahead than the wheel covers wait in the top level, being cascaded back into it until they are in range.
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1ul)
+#define WHEEL_LEVELS 4
+#define WHEEL_RANGE (1ul << (WHEEL_BITS * WHEEL_LEVELS)) // Number of ticks ahead the wheel covers
+
+static CymricTimer *s_wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+
+// Last tick the wheel was advanced to
+static uint32_t s_now;
+
+// Number of timers running
+static uint32_t s_active;
+
+// Timers whose callbacks are waiting to be run by the timer task, in the order they expired
+static CymricTimer *s_queue_head;
+static CymricTimer *s_queue_tail;
+
+static CymricTask *s_timer_task;
+
+// Insert a timer into the slot of the wheel corresponding to its expiry.  Must be called in a critical section.
+static void prv_wheel_insert(CymricTimer *timer) {
+	uint32_t expiry = timer->expiry;
+	uint32_t delta = expiry - s_now;
+	if(delta >= WHEEL_RANGE) {
+		// Park it in the top level until it comes within range
+		delta = WHEEL_RANGE - 1;
+		expiry = s_now + delta;
+	}
+
+	// Use the lowest level whose turn covers the delay
+	uint8_t level = 0;
+	while(delta >= (1ul << (WHEEL_BITS * (level + 1)))) {
+		level++;
+	}
+
+	CymricTimer **slot = &s_wheel[level][(expiry >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	timer->next = *slot;
+	if(*slot) {
+		(*slot)->pprev = &timer->next;
+	}
+	timer->pprev = slot;
+	*slot = timer;
+}
+
+// Remove a timer from the wheel.  Must be called in a critical section.
+static void prv_wheel_remove(CymricTimer *timer) {
+	*timer->pprev = timer->next;
+	if(timer->next) {
+		timer->next->pprev = timer->pprev;
+	}
+}
+
+// Detach the list of timers in a slot of the wheel, returning its head.
+static CymricTimer *prv_slot_take(uint8_t level, uint32_t index) {
+	CymricTimer *head = s_wheel[level][index];
+	s_wheel[level][index] = NULL;
+	return head;
+}
+
+// Queue a timer's callback to be run by the timer task.
+static void prv_queue(CymricTimer *timer) {
+	timer->run_pending = true;
+	if(timer->queued) {
+		// The callback from its last expiry hasn't run yet; only run it once
+		return;
+	}
+
+	timer->queued = true;
+	timer->queue_next = NULL;
+	if(s_queue_tail) {
+		s_queue_tail->queue_next = timer;
+	} else {
+		s_queue_head = timer;
+	}
+	s_queue_tail = timer;
+}
+
+void cymric_timer_tick(void) {
+	s_now++;
+
+	// When level 0 comes back around, cascade the slot reached at each level above it, from the top down so that
+	// timers can fall more than one level
+	if(!(s_now & WHEEL_MASK)) {
+		for(uint8_t level = WHEEL_LEVELS - 1; level > 0; level--) {
+			if(s_now & ((1ul << (WHEEL_BITS * level)) - 1)) {
+				continue;
+			}
+
+			CymricTimer *timer = prv_slot_take(level, (s_now >> (WHEEL_BITS * level)) & WHEEL_MASK);
+			while(timer) {
+				CymricTimer *next = timer->next;
+				prv_wheel_insert(timer);
+				timer = next;
+			}
+		}
+	}
+
+	// Every timer in the current level 0 slot expires now
+	CymricTimer *timer = prv_slot_take(0, s_now & WHEEL_MASK);
+	if(!timer) {
+		return;
+	}
+
+	while(timer) {
+		CymricTimer *next = timer->next;
+		if(timer->periodic) {
+			// Restart relative to the expiry so that the period doesn't drift
+			timer->expiry += timer->period_ms;
+			prv_wheel_insert(timer);
+		} else {
+			timer->active = false;
+			s_active--;
+		}
+		prv_queue(timer);
+		timer = next;
+	}
+
+	cymric_task_notify_from_isr(s_timer_task);
+}
+
+uint32_t cymric_timer_idle_ticks(void) {
+	if(!s_active) {
+		return CYMRIC_TIMEOUT_FOREVER;
+	}
+
+	// Find the next level 0 slot with timers in it, stopping at the next tick on which the higher levels are
+	// cascaded (which may move timers into level 0)
+	uint32_t ticks = 1;
+	for(; ticks < WHEEL_SLOTS; ticks++) {
+		uint32_t index = (s_now + ticks) & WHEEL_MASK;
+		if(!index || s_wheel[0][index]) {
+			break;
+		}
+	}
+	return ticks;
+}
+
+void cymric_timer_skip(uint32_t ticks) {
+	// None of the ticks skipped have any work to do
+	s_now += ticks;
+}
+
+// Task which runs the callbacks of expired timers.
+static void prv_timer_task(void *args) {
+	while(1) {
+		cymric_task_notify_wait(CYMRIC_TIMEOUT_FOREVER);
+
+		while(1) {
+			uint32_t mask = cymric_critical_enter();
+			CymricTimer *timer = s_queue_head;
+			if(!timer) {
+				cymric_critical_exit(mask);
+				break;
+			}
+
+			s_queue_head = timer->queue_next;
+			if(!s_queue_head) {
+				s_queue_tail = NULL;
+			}
+			timer->queued = false;
+
+			// The timer may have been stopped since it expired
+			bool run = timer->run_pending;
+			timer->run_pending = false;
+			cymric_critical_exit(mask);
+
+			if(run) {
+				timer->callback(timer->args);
+			}
+		}
+	}
+}
+
+bool cymric_timer_service_init(void) {
+	s_timer_task = cymric_task_new(prv_timer_task, NULL, CYMRIC_TIMER_TASK_PRI);
+	return s_timer_task != NULL;
+}
+
+CymricTimer cymric_timer_init(CymricTimerCallback callback, void *args, uint32_t period_ms, bool periodic) {
+	CymricTimer timer = {
+		.callback = callback,
+		.args = args,
+		.period_ms = period_ms,
+		.periodic = periodic,
+		.active = false,
+		.queued = false,
+		.run_pending = false,
+	};
+	return timer;
+}
+
+bool cymric_timer_start(CymricTimer *timer) {
+	if(!timer->period_ms) return false;
+
+	uint32_t mask = cymric_critical_enter();
+	if(timer->active) {
+		prv_wheel_remove(timer);
+	} else {
+		timer->active = true;
+		s_active++;
+	}
+
+	timer->expiry = s_now + timer->period_ms;
+	prv_wheel_insert(timer);
+	cymric_critical_exit(mask);
+
+	return true;
+}
+
+void cymric_timer_stop(CymricTimer *timer) {
+	uint32_t mask = cymric_critical_enter();
+	if(timer->active) {
+		prv_wheel_remove(timer);
+		timer->active = false;
+		s_active--;
+	}
+
+	// Cancel a callback that hasn't run yet.  The timer task skips over it if it is queued.
+	timer->run_pending = false;
+	cymric_critical_exit(mask);
+}
+
+bool cymric_timer_change_period(CymricTimer *timer, uint32_t period_ms) {
+	if(!period_ms) return false;
+
+	uint32_t mask = cymric_critical_enter();
+	timer->period_ms = period_ms;
+	cymric_timer_start(timer);
+	cymric_critical_exit(mask);
+
+	return true;
+}
+
+bool cymric_timer_is_active(CymricTimer *timer) {
+	return timer->active;
+}
+
+#endif
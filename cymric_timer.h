@@ -0,0 +1,43 @@
+// Software timers, whose callbacks run in the timer task (enabled with CYMRIC_TIMERS).
+#pragma once
+
+#include <inttypes.h>
+#include <stdbool.h>
+
+#include "cymric.h"
+
+// Timer callback definition.
+typedef void (*CymricTimerCallback)(void *args);
+
+typedef struct CymricTimer {
+	CymricTimerCallback callback;
+	void *args;
+	uint32_t period_ms;
+	bool periodic; // Restart automatically each time the timer expires
+
+	// Managed by the kernel
+	bool active; // Running, in the timing wheel
+	bool queued; // In the list of timers whose callbacks the timer task will run
+	bool run_pending; // Whether the callback should be run when the timer task reaches it in that list
+	uint32_t expiry; // Tick that the timer expires on
+	struct CymricTimer *next; // Next timer in the same timing wheel slot
+	struct CymricTimer **pprev; // Pointer to the pointer to this timer in its timing wheel slot
+	struct CymricTimer *queue_next; // Next timer whose callback is to be run
+} CymricTimer;
+
+// Initialize a stopped timer which calls callback(args) from the timer task period_ms after it is started, and
+// then every period_ms if periodic is set.
+CymricTimer cymric_timer_init(CymricTimerCallback callback, void *args, uint32_t period_ms, bool periodic);
+
+// Start a timer, or restart it if it is already running, so that it expires period_ms from now.  Returns false
+// if the period is 0.  Like the other timer functions, this can also be called from interrupt handlers.
+bool cymric_timer_start(CymricTimer *timer);
+
+// Stop a timer.  Its callback isn't called again until it is restarted, even if it has already expired.
+void cymric_timer_stop(CymricTimer *timer);
+
+// Change the period of a timer and restart it.  Returns false if the period is 0.
+bool cymric_timer_change_period(CymricTimer *timer, uint32_t period_ms);
+
+// Returns whether a timer is running.
+bool cymric_timer_is_active(CymricTimer *timer);
@@ -6,6 +6,7 @@
 #include "cymric.h"
 #include "cymric_semaphore.h"
 #include "cymric_mutex.h"
+#include "cymric_queue.h"
 
 // Initialize the GPIO pin corresponding to LED2 on the nucleo board
 static void prv_led_gpio_init(void) {
@@ -37,34 +38,45 @@ static void prv_btn_gpio_init(void) {
 
 // Tasks for testing the RTOS.
 
-// LED blink interval, controlled by button state
-static uint32_t s_blink_delay_ms = 500;
+// LED blink intervals, sent by the button task whenever the button state changes
+static uint32_t s_blink_queue_buf[4];
+static CymricQueue s_blink_queue;
 
 // Delays for LED when button pressed/unpressed
 static uint32_t s_blink_interval_ms[2] = {100, 500};
 
 // Blink the LED.
 static void prv_led_blink(void *args) {
+	CymricQueue *queue = args;
+	uint32_t blink_delay_ms = 500;
 	while(1) {
 		//asm("nop");
 		LED_ON();
-		cymric_delay(s_blink_delay_ms);
+		cymric_delay(blink_delay_ms);
 		LED_OFF();
-		cymric_delay(s_blink_delay_ms);
+		
+		// Wait out the off period, picking up any new interval sent in the meantime
+		cymric_queue_receive(queue, &blink_delay_ms, blink_delay_ms);
 	}
 }
 
 // Read the button and adjust the blink LED depending on its state.
 static void prv_btn_read(void *args) {
-	uint32_t *blink_delays_ms = (uint32_t*)args;
+	CymricQueue *queue = args;
+	GPIO_PinState prev_state = GPIO_PIN_SET;
 	while(1) {
-		// Read from the button and update the blink delay correspondingly.
-		if(HAL_GPIO_ReadPin(GPIOC, GPIO_PIN_13) == GPIO_PIN_RESET) {
-			// Button pressed
-			s_blink_delay_ms = blink_delays_ms[0];
-		} else {
-			// Button released
-			s_blink_delay_ms = blink_delays_ms[1];
+		// Read from the button and send the blink delay correspondingly.
+		GPIO_PinState state = HAL_GPIO_ReadPin(GPIOC, GPIO_PIN_13);
+		if(state != prev_state) {
+			prev_state = state;
+			if(state == GPIO_PIN_RESET) {
+				// Button pressed
+				cymric_queue_send(queue, &s_blink_interval_ms[0], CYMRIC_TIMEOUT_FOREVER);
+			} else {
+				// Button released
+				cymric_queue_send(queue, &s_blink_interval_ms[1], CYMRIC_TIMEOUT_FOREVER);
+			}
+			cymric_delay(10); // Debouncing
 		}
 	}
 }
@@ -143,8 +155,9 @@ int main(void) {
 	cymric_start();
 		
 	// Tasks to vary LED blink rate based on button press (unreached, left uncommented to remove warnings)
-	cymric_task_new(&prv_led_blink, NULL, CYMRIC_PRI_HIGH);
-	cymric_task_new(&prv_btn_read, s_blink_interval_ms, CYMRIC_PRI_HIGH);
+	s_blink_queue = cymric_queue_init(s_blink_queue_buf, sizeof(uint32_t), 4);
+	cymric_task_new(&prv_led_blink, &s_blink_queue, CYMRIC_PRI_HIGH);
+	cymric_task_new(&prv_btn_read, &s_blink_queue, CYMRIC_PRI_HIGH);
 
 	// Tasks to turn LED on/off using semaphores and button press (unreached, left uncommented to remove warnings)
 	s_sem = cymric_sem_init(0);
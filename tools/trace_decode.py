@@ -0,0 +1,114 @@
+#!/usr/bin/env python3
+# Decode the cymric_trace context switch buffer (built with CYMRIC_TRACE set in cymric.h) from a RAM dump
+# into a timeline.
+#
+# The dump can be a raw binary image or an Intel HEX file, such as one of the STM32F446's SRAM written by the
+# uVision debugger with:
+#   SAVE trace.hex 0x20000000, 0x2001FFFF
+# The buffer is found by searching for CYMRIC_TRACE_MAGIC unless its offset into the dump is given.
+#
+# Usage: trace_decode.py [--offset N] [--clock HZ] [--name ID=NAME ...] DUMP
+
+import argparse
+import struct
+import sys
+
+# Must match cymric.h
+TRACE_MAGIC = 0x52545943
+HEADER = struct.Struct("<III") # magic, size, count
+EVENT = struct.Struct("<IBBBB") # timestamp, reason, from_id, to_id, to_pri
+REASONS = ["tick", "yield", "block", "wake", "preempt", "delete"]
+
+
+def read_dump(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if not data.startswith(b":"):
+        return data
+
+    # Intel HEX: place each data record at its address, relative to the lowest one
+    records = {}
+    upper = 0
+    for line in data.decode("ascii").split():
+        raw = bytes.fromhex(line[1:])
+        length, addr, kind = raw[0], (raw[1] << 8) | raw[2], raw[3]
+        payload = raw[4:4 + length]
+        if kind == 0:
+            records[upper + addr] = payload
+        elif kind == 2:
+            upper = int.from_bytes(payload, "big") << 4
+        elif kind == 4:
+            upper = int.from_bytes(payload, "big") << 16
+        elif kind == 1:
+            break
+
+    base = min(records)
+    image = bytearray(max(a + len(p) for a, p in records.items()) - base)
+    for addr, payload in records.items():
+        image[addr - base:addr - base + len(payload)] = payload
+    return bytes(image)
+
+
+def find_trace(data):
+    # The magic is followed by a power-of-2 size, which makes false matches unlikely
+    magic = struct.pack("<I", TRACE_MAGIC)
+    pos = data.find(magic)
+    while pos >= 0:
+        if pos % 4 == 0 and pos + HEADER.size <= len(data):
+            size = HEADER.unpack_from(data, pos)[1]
+            if size and not size & (size - 1) and pos + HEADER.size + size * EVENT.size <= len(data):
+                return pos
+        pos = data.find(magic, pos + 1)
+    sys.exit("trace buffer not found in dump")
+
+
+def decode(data, offset):
+    magic, size, count = HEADER.unpack_from(data, offset)
+    if magic != TRACE_MAGIC:
+        sys.exit("no trace buffer at offset 0x%x" % offset)
+
+    # Oldest event first.  Only the last `size` events are still in the buffer.
+    first = max(0, count - size)
+    events = []
+    for seq in range(first, count):
+        events.append((seq,) + EVENT.unpack_from(data, offset + HEADER.size + (seq % size) * EVENT.size))
+    return events, count
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode a cymric context switch trace from a RAM dump.")
+    parser.add_argument("dump", help="raw binary or Intel HEX dump containing cymric_trace")
+    parser.add_argument("--offset", type=lambda s: int(s, 0), help="offset of cymric_trace in the dump")
+    parser.add_argument("--clock", type=float, help="processor clock in Hz, to show times in microseconds")
+    parser.add_argument("--name", action="append", default=[], metavar="ID=NAME", help="name a task ID")
+    args = parser.parse_args()
+
+    names = {}
+    for entry in args.name:
+        task_id, name = entry.split("=", 1)
+        names[int(task_id, 0)] = name
+
+    def task(task_id):
+        return names.get(task_id, "task %d" % task_id)
+
+    data = read_dump(args.dump)
+    offset = args.offset if args.offset is not None else find_trace(data)
+    events, count = decode(data, offset)
+    if count > len(events):
+        print("# %d earlier events were overwritten" % (count - len(events)))
+
+    # Timestamps are a free-running 32-bit cycle count; accumulate the differences between them to handle wrapping
+    elapsed = 0
+    prev = None
+    for seq, timestamp, reason, from_id, to_id, to_pri in events:
+        if prev is not None:
+            elapsed += (timestamp - prev) & 0xFFFFFFFF
+        prev = timestamp
+
+        when = "%12.1f us" % (elapsed * 1e6 / args.clock) if args.clock else "%12d cyc" % elapsed
+        why = REASONS[reason] if reason < len(REASONS) else "reason %d" % reason
+        print("%s  #%-6d %-8s %s -> %s (pri %d)" % (when, seq, why, task(from_id), task(to_id), to_pri))
+
+
+if __name__ == "__main__":
+    main()